@@ -14,6 +14,30 @@ enum class AllocOp {
     CudaDeviceMalloc,
     CudaManagedMalloc,
     CudaFree,
+    // address space changes traced with mmap:1, these describe regions:
+    // a Munmap may cover part of a mapping or several of them, Brk is the
+    // program break moving up and a shrinking break is a Munmap, Madvise
+    // keeps the advice in align
+    Mmap,
+    Munmap,
+    Mremap,
+    Brk,
+    Madvise,
+    // blocks served by a user std::pmr::memory_resource wrapped in a
+    // mallocvis::tracing_resource, `resource` tells which
+    ResourceAllocate,
+    ResourceDeallocate,
+    // a sample of the process memory counters taken every counters:<ms>,
+    // size holds the value and align the CounterKind
+    Counter,
+    // a named point in time from mallocvis_marker(), ptr is null and tag
+    // holds the marker name
+    Marker,
+    // a thread's first event and its exit; ptr is null, tag names the thread
+    // in the tag table, size holds the tid of the creating thread, if known,
+    // and a ThreadStart's caller and stack are where it was created
+    ThreadStart,
+    ThreadExit,
     Unknown,
 };
 
@@ -25,6 +49,28 @@ struct AllocAction {
     size_t align;
     void *caller;
     int64_t time;
+    // bytes a sampled allocation stands for, 0 if every event was recorded
+    uint64_t weight;
+    // id in the stack table, 0 if no call stack was captured
+    uint32_t stack;
+    // id of the innermost mallocvis::Scope tag, 0 if none
+    uint32_t tag;
+    // time spent in the underlying allocator call, 0 unless captured with
+    // latency:1
+    int64_t latency;
+    // bytes the allocator handed out beyond size, from malloc_usable_size;
+    // 0 unless captured with usable:1
+    uint64_t slack;
+    // id of the mallocvis::tracing_resource of a Resource op, which also
+    // names it in the tag table; 0 for other ops
+    uint32_t resource;
+    // Lamport timestamp of a heap or resource event: it grows along each
+    // thread and along each address, so that the events of one block are
+    // ordered exactly even when their times tie; 0 if not captured
+    uint64_t seq;
+    // number of the CPU the event ran on plus one, 0 unless captured with
+    // cpu:1
+    uint32_t cpu;
 };
 
 constexpr const char *kAllocOpNames[] = {
@@ -38,6 +84,17 @@ constexpr const char *kAllocOpNames[] = {
     "CudaDeviceMalloc",
     "CudaManagedMalloc",
     "CudaFree",
+    "Mmap",
+    "Munmap",
+    "Mremap",
+    "Brk",
+    "Madvise",
+    "ResourceAllocate",
+    "ResourceDeallocate",
+    "Counter",
+    "Marker",
+    "ThreadStart",
+    "ThreadExit",
     "Unknown",
 };
 
@@ -52,6 +109,17 @@ constexpr bool kAllocOpIsAllocation[] = {
     true,
     true,
     false,
+    true,
+    false,
+    true,
+    true,
+    false,
+    true,
+    false,
+    false,
+    false,
+    false,
+    false,
     false,
 };
 
@@ -67,6 +135,17 @@ constexpr bool kAllocOpIsCpp[] = {
     false,
     false,
     false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
 };
 
 constexpr bool kAllocOpIsC[] = {
@@ -81,6 +160,17 @@ constexpr bool kAllocOpIsC[] = {
     false,
     false,
     false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
 };
 
 constexpr bool kAllocOpIsCuda[] = {
@@ -95,6 +185,67 @@ constexpr bool kAllocOpIsCuda[] = {
     true,
     true,
     false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+};
+
+constexpr bool kAllocOpIsRegion[] = {
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    true,
+    true,
+    true,
+    true,
+    true,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+};
+
+constexpr bool kAllocOpIsResource[] = {
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    false,
+    true,
+    true,
+    false,
+    false,
+    false,
+    false,
+    false,
 };
 
 constexpr AllocOp kAllocOpFreeFunction[] = {
@@ -108,7 +259,44 @@ constexpr AllocOp kAllocOpFreeFunction[] = {
     AllocOp::CudaFree,
     AllocOp::CudaFree,
     AllocOp::Unknown,
+    AllocOp::Munmap,
     AllocOp::Unknown,
+    AllocOp::Munmap,
+    AllocOp::Munmap,
+    AllocOp::Unknown,
+    AllocOp::ResourceDeallocate,
+    AllocOp::Unknown,
+    AllocOp::Unknown,
+    AllocOp::Unknown,
+    AllocOp::Unknown,
+    AllocOp::Unknown,
+    AllocOp::Unknown,
+};
+
+enum class CounterKind {
+    // resident set size in bytes, from /proc/self/statm
+    Rss,
+    // faults so far, from getrusage
+    MinorFaults,
+    MajorFaults,
+    // glibc's mallinfo2: bytes obtained from the system by the arenas and by
+    // mmap, bytes handed out, free bytes in the arenas and releasable top
+    HeapMapped,
+    HeapInUse,
+    HeapFree,
+    HeapTopPad,
+    Unknown,
+};
+
+constexpr const char *kCounterKindNames[] = {
+    "RSS",
+    "MinorFaults",
+    "MajorFaults",
+    "HeapMapped",
+    "HeapInUse",
+    "HeapFree",
+    "HeapTopPad",
+    "Unknown",
 };
 
 constexpr size_t kNone = (size_t)-1;
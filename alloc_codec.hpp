@@ -0,0 +1,569 @@
+#pragma once
+
+#include "alloc_action.hpp"
+#include "trace_clock.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Compact encoding of a per-thread AllocAction stream. Each record is:
+//
+//   u8      op | flags
+//   varint  zigzag(time - last_time)
+//   varint  zigzag(ptr - last_ptr)
+//   varint  size                      (if kCodecHasSize)
+//   varint  align                     (if kCodecHasAlign)
+//   varint  caller id << 1 | is_new
+//   varint  caller address            (if is_new)
+//   varint  extension mask            (if kCodecHasExt)
+//   varint  one per kCodecExt* bit set, in bit order
+//
+// A record whose op is kCodecStreamBegin carries the varint tid of the thread
+// now writing to the stream and resets all delta and caller state. Caller ids
+// are assigned in order of first appearance, so the decoder rebuilds the same
+// table; once kCodecMaxCallers are known, new callers are always sent inline.
+// Records may be cut anywhere when a stream is stored in pieces, see
+// AllocActionStreamDecoder. A default capture takes about 8 to 10 bytes per
+// event, 2 of them for kCodecExtSeq, against 56 for a raw AllocAction.
+
+constexpr uint8_t kCodecOpMask = 0x1f;
+constexpr uint8_t kCodecHasSize = 0x20;
+constexpr uint8_t kCodecHasAlign = 0x40;
+constexpr uint8_t kCodecHasExt = 0x80;
+constexpr uint8_t kCodecStreamBegin = 0x1f;
+
+constexpr uint32_t kCodecExtWeight = 1 << 0;
+constexpr uint32_t kCodecExtStack = 1 << 1;
+constexpr uint32_t kCodecExtTag = 1 << 2;
+constexpr uint32_t kCodecExtLatency = 1 << 3;
+constexpr uint32_t kCodecExtSlack = 1 << 4;
+constexpr uint32_t kCodecExtResource = 1 << 5;
+constexpr uint32_t kCodecExtSeq = 1 << 6;
+constexpr uint32_t kCodecExtCpu = 1 << 7;
+
+constexpr size_t kCodecMaxCallers = 4096;
+constexpr size_t kCodecMaxExtFields = 8;
+constexpr size_t kCodecMaxRecordSize = 1 + 10 * (7 + kCodecMaxExtFields);
+
+static_assert((size_t)AllocOp::Unknown < kCodecStreamBegin,
+              "AllocOp must fit in the op bits of a record");
+
+inline unsigned char *codec_put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+inline uint64_t codec_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t codec_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+struct AllocActionEncoder {
+    static constexpr size_t kTableSize = kCodecMaxCallers * 2;
+
+    int64_t last_time;
+    uintptr_t last_ptr;
+    uint64_t last_seq;
+    size_t num_callers;
+    uintptr_t caller_keys[kTableSize];
+    uint32_t caller_ids[kTableSize];
+
+    size_t begin(unsigned char *out, uint32_t tid) {
+        last_time = 0;
+        last_ptr = 0;
+        last_seq = 0;
+        num_callers = 0;
+        std::memset(caller_keys, 0, sizeof(caller_keys));
+        unsigned char *p = out;
+        *p++ = kCodecStreamBegin;
+        p = codec_put_varint(p, tid);
+        return p - out;
+    }
+
+    size_t encode(unsigned char *out, AllocAction const &action) {
+        unsigned char *p = out + 1;
+        uint8_t head = (uint8_t)action.op;
+        p = codec_put_varint(p, codec_zigzag(action.time - last_time));
+        last_time = action.time;
+        p = codec_put_varint(
+            p, codec_zigzag((int64_t)((uintptr_t)action.ptr - last_ptr)));
+        last_ptr = (uintptr_t)action.ptr;
+        if (action.size != kNone) {
+            head |= kCodecHasSize;
+            p = codec_put_varint(p, action.size);
+        }
+        if (action.align != kNone) {
+            head |= kCodecHasAlign;
+            p = codec_put_varint(p, action.align);
+        }
+        uintptr_t caller = (uintptr_t)action.caller;
+        uint32_t id;
+        if (intern_caller(caller, id)) {
+            p = codec_put_varint(p, (uint64_t)id << 1);
+        } else {
+            p = codec_put_varint(p, (uint64_t)id << 1 | 1);
+            p = codec_put_varint(p, caller);
+        }
+        uint32_t ext = 0;
+        if (action.weight) {
+            ext |= kCodecExtWeight;
+        }
+        if (action.stack) {
+            ext |= kCodecExtStack;
+        }
+        if (action.tag) {
+            ext |= kCodecExtTag;
+        }
+        if (action.latency > 0) {
+            ext |= kCodecExtLatency;
+        }
+        if (action.slack) {
+            ext |= kCodecExtSlack;
+        }
+        if (action.resource) {
+            ext |= kCodecExtResource;
+        }
+        if (action.seq) {
+            ext |= kCodecExtSeq;
+        }
+        if (action.cpu) {
+            ext |= kCodecExtCpu;
+        }
+        if (ext) {
+            head |= kCodecHasExt;
+            p = codec_put_varint(p, ext);
+            if (ext & kCodecExtWeight) {
+                p = codec_put_varint(p, action.weight);
+            }
+            if (ext & kCodecExtStack) {
+                p = codec_put_varint(p, action.stack);
+            }
+            if (ext & kCodecExtTag) {
+                p = codec_put_varint(p, action.tag);
+            }
+            if (ext & kCodecExtLatency) {
+                p = codec_put_varint(p, (uint64_t)action.latency);
+            }
+            if (ext & kCodecExtSlack) {
+                p = codec_put_varint(p, action.slack);
+            }
+            if (ext & kCodecExtResource) {
+                p = codec_put_varint(p, action.resource);
+            }
+            // a thread's sequence numbers mostly grow by small steps
+            if (ext & kCodecExtSeq) {
+                p = codec_put_varint(
+                    p, codec_zigzag((int64_t)(action.seq - last_seq)));
+                last_seq = action.seq;
+            }
+            if (ext & kCodecExtCpu) {
+                p = codec_put_varint(p, action.cpu);
+            }
+        }
+        *out = head;
+        return p - out;
+    }
+
+private:
+    // returns true if caller already had an id, key 0 marks an empty slot so
+    // null callers are stored as (uintptr_t)-1
+    bool intern_caller(uintptr_t caller, uint32_t &id) {
+        uintptr_t key = caller ? caller : (uintptr_t)-1;
+        size_t i = (size_t)((key >> 2) * 0x9E3779B97F4A7C15ull) % kTableSize;
+        while (caller_keys[i]) {
+            if (caller_keys[i] == key) {
+                id = caller_ids[i];
+                return true;
+            }
+            i = (i + 1) % kTableSize;
+        }
+        id = (uint32_t)num_callers;
+        if (num_callers < kCodecMaxCallers) {
+            caller_keys[i] = key;
+            caller_ids[i] = id;
+            ++num_callers;
+        }
+        return false;
+    }
+};
+
+struct AllocActionDecoder {
+    uint32_t tid = 0;
+    int64_t last_time = 0;
+    uintptr_t last_ptr = 0;
+    uint64_t last_seq = 0;
+    std::vector<void *> callers;
+
+    // decodes the next action from [it, end), stream begin records are
+    // consumed silently; returns false once the input is exhausted, leaving
+    // `it` at the start of a record cut short by `end`
+    template <class It>
+    bool decode(It &it, It end, AllocAction &action) {
+        while (it != end) {
+            It start = it;
+            truncated = false;
+            uint8_t head = (uint8_t)*it++;
+            if ((head & kCodecOpMask) == kCodecStreamBegin) {
+                uint64_t new_tid = get_varint(it, end);
+                if (truncated) {
+                    it = start;
+                    return false;
+                }
+                tid = (uint32_t)new_tid;
+                last_time = 0;
+                last_ptr = 0;
+                last_seq = 0;
+                callers.clear();
+                continue;
+            }
+            int64_t time = codec_unzigzag(get_varint(it, end));
+            int64_t ptr = codec_unzigzag(get_varint(it, end));
+            size_t size = head & kCodecHasSize ? get_varint(it, end) : kNone;
+            size_t align = head & kCodecHasAlign ? get_varint(it, end) : kNone;
+            uint64_t id = get_varint(it, end);
+            uint64_t caller = id & 1 ? get_varint(it, end) : 0;
+            uint64_t ext = head & kCodecHasExt ? get_varint(it, end) : 0;
+            uint64_t weight = ext & kCodecExtWeight ? get_varint(it, end) : 0;
+            uint64_t stack = ext & kCodecExtStack ? get_varint(it, end) : 0;
+            uint64_t tag = ext & kCodecExtTag ? get_varint(it, end) : 0;
+            uint64_t latency =
+                ext & kCodecExtLatency ? get_varint(it, end) : 0;
+            uint64_t slack = ext & kCodecExtSlack ? get_varint(it, end) : 0;
+            uint64_t resource =
+                ext & kCodecExtResource ? get_varint(it, end) : 0;
+            uint64_t seq = ext & kCodecExtSeq ? get_varint(it, end) : 0;
+            uint64_t cpu = ext & kCodecExtCpu ? get_varint(it, end) : 0;
+            if (truncated) {
+                it = start;
+                return false;
+            }
+            action.op = (AllocOp)(head & kCodecOpMask);
+            action.tid = tid;
+            last_time += time;
+            action.time = last_time;
+            last_ptr += (uintptr_t)ptr;
+            action.ptr = (void *)last_ptr;
+            action.size = size;
+            action.align = align;
+            if (id & 1) {
+                action.caller = (void *)(uintptr_t)caller;
+                if (callers.size() < kCodecMaxCallers) {
+                    callers.push_back(action.caller);
+                }
+            } else {
+                id >>= 1;
+                action.caller = id < callers.size() ? callers[id] : nullptr;
+            }
+            action.weight = weight;
+            action.stack = (uint32_t)stack;
+            action.tag = (uint32_t)tag;
+            action.latency = (int64_t)latency;
+            action.slack = slack;
+            action.resource = (uint32_t)resource;
+            action.seq = 0;
+            if (ext & kCodecExtSeq) {
+                last_seq += (uint64_t)codec_unzigzag(seq);
+                action.seq = last_seq;
+            }
+            action.cpu = (uint32_t)cpu;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    bool truncated = false;
+
+    template <class It>
+    uint64_t get_varint(It &it, It end) {
+        uint64_t v = 0;
+        int shift = 0;
+        while (it != end) {
+            uint8_t b = (uint8_t)*it++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+            shift += 7;
+        }
+        truncated = true;
+        return v;
+    }
+};
+
+// decodes a stream that arrives in pieces cut at arbitrary bytes, the start
+// of a record cut off at the end of one piece is kept until the next arrives
+struct AllocActionStreamDecoder {
+    AllocActionDecoder decoder;
+    std::vector<unsigned char> carry;
+
+    template <class Func>
+    void feed(unsigned char const *data, size_t size, Func &&func) {
+        AllocAction action;
+        if (!carry.empty()) {
+            size_t old = carry.size();
+            size_t take = std::min(size, kCodecMaxRecordSize);
+            carry.insert(carry.end(), data, data + take);
+            auto it = carry.cbegin();
+            while ((size_t)(it - carry.cbegin()) < old &&
+                   decoder.decode(it, carry.cend(), action)) {
+                func(action);
+            }
+            size_t used = it - carry.cbegin();
+            if (used < old) {
+                if (take == size) {
+                    carry.erase(carry.begin(), carry.begin() + used);
+                    return;
+                }
+                // longer than any record, the stream is corrupt
+                used = old + take;
+            }
+            data += used - old;
+            size -= used - old;
+            carry.clear();
+        }
+        auto it = data;
+        while (decoder.decode(it, data + size, action)) {
+            func(action);
+        }
+        carry.assign(it, data + size);
+    }
+};
+
+// converts the time and latency of a decoded action from raw ticks to
+// nanoseconds
+inline void trace_action_to_ns(AllocAction &action,
+                               TraceClockCalibration const &clock) {
+    int64_t ticks = action.time;
+    action.time = clock.to_ns(ticks);
+    if (action.latency) {
+        action.latency = clock.to_ns(ticks + action.latency) - action.time;
+    }
+}
+
+// on-disk trace: a sequence of frames, each a header followed by `size` bytes
+// of the encoded stream identified by `stream`. Frames of kTraceClockStream
+// hold a TraceClockCalibration instead, action times are left in raw ticks
+// for trace_action_to_ns; a stream repeats the frame before each batch under
+// clock:tsc, so that a live reader can convert as it goes.
+// Frames of kTraceStackStream hold stack table entries, each a u32 id, a u32
+// depth and `depth` frame addresses. Frames of kTraceTagStream hold tag
+// names, each a u32 id, a u32 length and `length` bytes. A frame of
+// kTraceProcessStream holds the u32 pid of the writer and the u32 pid of the
+// traced process it was forked from, or 0.
+struct TraceFrameHeader {
+    uint32_t stream;
+    uint32_t size;
+};
+
+constexpr uint32_t kTraceClockStream = 0xffffffff;
+constexpr uint32_t kTraceStackStream = 0xfffffffe;
+constexpr uint32_t kTraceTagStream = 0xfffffffd;
+constexpr uint32_t kTraceProcessStream = 0xfffffffc;
+
+// everything in a trace besides the actions themselves
+struct TraceMetadata {
+    TraceClockCalibration clock;
+    // frames of each stack id, innermost first, stacks[0] is unused
+    std::vector<std::vector<void *>> stacks;
+    // name of each tag id, tags[0] is unused
+    std::vector<std::string> tags;
+    // pid of each traced process forked from another traced process, and the
+    // pid of that parent
+    std::unordered_map<uint32_t, uint32_t> parent_pids;
+};
+
+template <class Func>
+inline void read_trace_frames(std::istream &in, Func &&func,
+                              TraceMetadata *meta = nullptr) {
+    std::unordered_map<uint32_t, AllocActionStreamDecoder> decoders;
+    std::vector<char> buf;
+    TraceFrameHeader header;
+    while (in.read((char *)&header, sizeof(header))) {
+        buf.resize(header.size);
+        if (!in.read(buf.data(), header.size)) {
+            break;
+        }
+        if (header.stream == kTraceClockStream) {
+            if (meta && header.size == sizeof(TraceClockCalibration)) {
+                std::memcpy((void *)&meta->clock, buf.data(), header.size);
+            }
+            continue;
+        }
+        if (header.stream == kTraceStackStream) {
+            for (size_t i = 0; meta && i + 8 <= buf.size();) {
+                uint32_t id, depth;
+                std::memcpy(&id, buf.data() + i, 4);
+                std::memcpy(&depth, buf.data() + i + 4, 4);
+                i += 8;
+                if (i + depth * sizeof(void *) > buf.size()) {
+                    break;
+                }
+                if (meta->stacks.size() <= id) {
+                    meta->stacks.resize(id + 1);
+                }
+                auto &frames = meta->stacks[id];
+                frames.resize(depth);
+                std::memcpy(frames.data(), buf.data() + i,
+                            depth * sizeof(void *));
+                i += depth * sizeof(void *);
+            }
+            continue;
+        }
+        if (header.stream == kTraceProcessStream) {
+            if (meta && header.size == 8) {
+                uint32_t pid, parent_pid;
+                std::memcpy(&pid, buf.data(), 4);
+                std::memcpy(&parent_pid, buf.data() + 4, 4);
+                if (parent_pid) {
+                    meta->parent_pids[pid] = parent_pid;
+                }
+            }
+            continue;
+        }
+        if (header.stream == kTraceTagStream) {
+            for (size_t i = 0; meta && i + 8 <= buf.size();) {
+                uint32_t id, length;
+                std::memcpy(&id, buf.data() + i, 4);
+                std::memcpy(&length, buf.data() + i + 4, 4);
+                i += 8;
+                if (i + length > buf.size()) {
+                    break;
+                }
+                if (meta->tags.size() <= id) {
+                    meta->tags.resize(id + 1);
+                }
+                meta->tags[id].assign(buf.data() + i, length);
+                i += length;
+            }
+            continue;
+        }
+        decoders[header.stream].feed((unsigned char const *)buf.data(),
+                                     buf.size(), func);
+    }
+}
+
+// trace directory: each thread's stream is split into segment files named
+// <pid>-<stream>-<sequence>.seg, each a TraceSegmentHeader padded to kSize
+// followed by `committed` bytes of the stream. Segments are written through
+// shared mappings and `committed` only covers whole records, so everything
+// committed before the process died is recovered. A clean exit also leaves
+// <pid>.meta, a trace holding the final clock and stack frames.
+struct TraceSegmentHeader {
+    static constexpr size_t kSize = 4096;
+
+    char magic[8];
+    uint32_t pid;
+    uint32_t stream;
+    uint64_t sequence;
+    uint64_t capacity;
+    std::atomic<uint64_t> committed;
+    // calibrated when the segment was created, for traces without a .meta
+    TraceClockCalibration clock;
+    // the traced process this one was forked from, 0 if none
+    uint32_t parent_pid;
+};
+
+constexpr char kTraceSegmentMagic[8] = "mvseg01";
+
+static_assert(sizeof(TraceSegmentHeader) <= TraceSegmentHeader::kSize,
+              "segment header must fit its page");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "committed length must be lock free in shared memory");
+
+// reads every segment in `dir`, or only those of process `pid` if non-zero
+template <class Func>
+inline void read_trace_segments(std::string const &dir, Func &&func,
+                                TraceMetadata *meta = nullptr,
+                                uint32_t pid = 0) {
+    struct Segment {
+        uint32_t pid;
+        uint32_t stream;
+        uint64_t sequence;
+        uint64_t committed;
+        std::filesystem::path path;
+    };
+
+    std::vector<Segment> segments;
+    std::error_code ec;
+    for (auto const &entry: std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".seg") {
+            continue;
+        }
+        std::ifstream in(entry.path(), std::ios::binary);
+        TraceSegmentHeader header;
+        if (!in.read((char *)&header, sizeof(header)) ||
+            std::memcmp(header.magic, kTraceSegmentMagic, 8) ||
+            (pid && header.pid != pid)) {
+            continue;
+        }
+        uint64_t committed = header.committed.load(std::memory_order_relaxed);
+        uint64_t file_size = entry.file_size(ec);
+        if (ec || file_size < TraceSegmentHeader::kSize) {
+            continue;
+        }
+        committed = std::min({committed, header.capacity,
+                              file_size - TraceSegmentHeader::kSize});
+        segments.push_back({header.pid, header.stream, header.sequence,
+                            committed, entry.path()});
+        if (meta && header.clock.ticks[1] > meta->clock.ticks[1]) {
+            meta->clock = header.clock;
+        }
+        if (meta && header.parent_pid) {
+            meta->parent_pids[header.pid] = header.parent_pid;
+        }
+    }
+    std::sort(segments.begin(), segments.end(),
+              [](Segment const &a, Segment const &b) {
+                  return std::tie(a.pid, a.stream, a.sequence) <
+                         std::tie(b.pid, b.stream, b.sequence);
+              });
+    AllocActionStreamDecoder decoder;
+    std::vector<unsigned char> buf;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        auto const &segment = segments[i];
+        // a missing segment breaks the delta chain, start over
+        if (!i || segment.pid != segments[i - 1].pid ||
+            segment.stream != segments[i - 1].stream ||
+            segment.sequence != segments[i - 1].sequence + 1) {
+            decoder = AllocActionStreamDecoder();
+        }
+        std::ifstream in(segment.path, std::ios::binary);
+        in.seekg(TraceSegmentHeader::kSize);
+        buf.resize(segment.committed);
+        if (in.read((char *)buf.data(), buf.size())) {
+            decoder.feed(buf.data(), buf.size(), func);
+        }
+    }
+    if (!meta) {
+        return;
+    }
+    std::vector<uint32_t> pids;
+    for (auto const &segment: segments) {
+        if (pids.empty() || pids.back() != segment.pid) {
+            pids.push_back(segment.pid);
+        }
+    }
+    for (uint32_t meta_pid: pids) {
+        std::ifstream in(std::filesystem::path(dir) /
+                             (std::to_string(meta_pid) + ".meta"),
+                         std::ios::binary);
+        read_trace_frames(in, [](AllocAction const &) {}, meta);
+    }
+}
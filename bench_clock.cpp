@@ -0,0 +1,52 @@
+#include "trace_clock.hpp"
+#include <benchmark/benchmark.h>
+#include <chrono>
+
+// cost of taking one event timestamp with each clock mallocvis can use
+
+static void BM_high_resolution_clock(benchmark::State &s) {
+    for (auto _: s) {
+        auto now = std::chrono::high_resolution_clock::now();
+        benchmark::DoNotOptimize(now);
+    }
+}
+BENCHMARK(BM_high_resolution_clock);
+
+static void BM_clock_monotonic(benchmark::State &s) {
+    for (auto _: s) {
+        benchmark::DoNotOptimize(trace_clock_monotonic());
+    }
+}
+BENCHMARK(BM_clock_monotonic);
+
+static void BM_clock_coarse(benchmark::State &s) {
+    for (auto _: s) {
+        benchmark::DoNotOptimize(trace_clock_coarse());
+    }
+}
+BENCHMARK(BM_clock_coarse);
+
+static void BM_clock_tsc(benchmark::State &s) {
+    if (!trace_clock_has_tsc()) {
+        s.SkipWithError("no invariant TSC");
+        return;
+    }
+    for (auto _: s) {
+        benchmark::DoNotOptimize(trace_clock_tsc());
+    }
+}
+BENCHMARK(BM_clock_tsc);
+
+static void BM_clock_tsc_to_ns(benchmark::State &s) {
+    TraceClockCalibration clock;
+    clock.kind = TraceClockKind::Tsc;
+    clock.ticks[0] = trace_clock_tsc();
+    clock.ns[0] = trace_clock_monotonic();
+    clock.ticks[1] = clock.ticks[0] + 3000000000;
+    clock.ns[1] = clock.ns[0] + 1000000000;
+    int64_t t = clock.ticks[0];
+    for (auto _: s) {
+        benchmark::DoNotOptimize(clock.to_ns(t += 100));
+    }
+}
+BENCHMARK(BM_clock_tsc_to_ns);
@@ -0,0 +1,58 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+
+// cost of one allocation and free through the hooks, in whatever capture mode
+// MALLOCVIS selects when the library loads; bench_hooks_baseline is the same
+// code without libmallocvis. `cmake --build . --target bench_hooks_json` runs
+// every mode and writes bench_hooks_<mode>.json
+
+static int max_threads() {
+    return (int)std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+static void hook_args(benchmark::internal::Benchmark *b) {
+    b->RangeMultiplier(8)->Range(16, 1 << 20);
+    b->ThreadRange(1, max_threads())->UseRealTime();
+}
+
+static void BM_malloc_free(benchmark::State &s) {
+    size_t size = (size_t)s.range(0);
+    for (auto _: s) {
+        void *p = malloc(size);
+        benchmark::DoNotOptimize(p);
+        free(p);
+    }
+    s.SetItemsProcessed(s.iterations());
+}
+BENCHMARK(BM_malloc_free)->Apply(hook_args);
+
+static void BM_new_delete(benchmark::State &s) {
+    size_t size = (size_t)s.range(0);
+    for (auto _: s) {
+        void *p = ::operator new(size);
+        benchmark::DoNotOptimize(p);
+        ::operator delete(p);
+    }
+    s.SetItemsProcessed(s.iterations());
+}
+BENCHMARK(BM_new_delete)->Apply(hook_args);
+
+int main(int argc, char **argv) {
+#if BENCH_HOOKS_BASELINE
+    benchmark::AddCustomContext("mallocvis", "none");
+#else
+    char const *env = std::getenv("MALLOCVIS");
+    benchmark::AddCustomContext("mallocvis", env ? env : "");
+#endif
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
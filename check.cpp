@@ -33,7 +33,7 @@ struct GlobalData {
         // kAllocOpNames[(size_t)op], ptr, size, align, caller);
         std::lock_guard<std::mutex> guard(lock);
         if (kAllocOpIsAllocation[(size_t)op]) {
-            auto result = allocated.insert({ptr, AllocAction{op, 0, ptr, size, align, caller, 0}});
+            auto result = allocated.insert({ptr, AllocAction{op, 0, ptr, size, align, caller, 0, 0, 0, 0, 0, 0, 0, 0, 0}});
             if (!result.second) {
                 printf("检测到内存多次分配同一个地址 ptr = %p, size = %zd, "
                         "caller = %s\n",
@@ -1,18 +1,55 @@
 #include "addr2sym.hpp"
+#include "mallocvis.h"
 #include "plot_actions.hpp"
+#include <algorithm>
 #include <atomic>
+#include <cctype>
 #include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdarg>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <fstream>
+#include <iostream>
 #include <mutex>
+#include <memory>
 #include <new>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #if __unix__
+# include <climits>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sched.h>
 # include <sys/mman.h>
+# include <sys/resource.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
 # include <unistd.h>
+# if __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+# endif
+# if __GNUC__
+#  include <unwind.h>
+# endif
+# if __has_include(<malloc.h>)
+#  include <malloc.h>
+# endif
+# if __has_include(<dlfcn.h>)
+#  include <dlfcn.h>
+# endif
+# if __has_include(<link.h>)
+#  include <link.h>
+#  define HAS_DL_ITERATE_PHDR 1
+# endif
 #if defined(__FreeBSD__)
 # include <pthread_np.h>
 # include <malloc_np.h>
@@ -22,227 +59,3362 @@
 # include <windows.h>
 # define MALLOCVIS_EXPORT // __declspec(dllexport)
 #endif
-#if __cplusplus >= 201703L || __cpp_lib_memory_resource
-# include <memory_resource>
+#include "alloc_action.hpp"
+#include "alloc_codec.hpp"
+#include "trace_clock.hpp"
+#if __GNUC__
+# define MALLOCVIS_NOINLINE __attribute__((noinline))
+#elif _MSC_VER
+# define MALLOCVIS_NOINLINE __declspec(noinline)
+#else
+# define MALLOCVIS_NOINLINE
+#endif
+
+#if __linux__ && __GLIBC__
+extern "C" void *__curbrk;
+#endif
+
+namespace {
+
+uint32_t get_thread_id() {
+#if defined(__FreeBSD__)
+    return pthread_getthreadid_np();
+#elif __unix__
+    return gettid();
+#elif _WIN32
+    return GetCurrentThreadId();
+#else
+    return 0;
+#endif
+}
+
+// the name given by pthread_setname_np, or else the one inherited from the
+// creating thread
+bool get_thread_name(char *name, size_t size) {
+#if __linux__ && __GLIBC__
+    return !pthread_getname_np(pthread_self(), name, size) && *name;
+#else
+    (void)name;
+    (void)size;
+    return false;
 #endif
-#if __cpp_lib_memory_resource
-# define PMR std::pmr
-# define PMR_RES(x) \
-     { x }
-# define HAS_PMR 1
+}
+
+// the CPU the calling thread runs on, -1 if unknown; glibc's sched_getcpu
+// goes through the vDSO getcpu
+int get_cpu_id() {
+#if __linux__ && __GLIBC__
+    return sched_getcpu();
+#elif _WIN32
+    return (int)GetCurrentProcessorNumber();
 #else
-# define PMR std
-# define PMR_RES(x)
-# define HAS_PMR 0
+    return -1;
 #endif
-#include "alloc_action.hpp"
+}
+
+uint32_t get_process_id() {
+#if __unix__
+    return (uint32_t)getpid();
+#elif _WIN32
+    return (uint32_t)GetCurrentProcessId();
+#else
+    return 0;
+#endif
+}
+
+#if __unix__
+// mallocvis' own mappings go straight to the kernel where possible, so that
+// they stay out of the address space traced by mmap:1
+void *sys_mmap(void *addr, size_t size, int prot, int flags, int fd,
+               off_t offset) {
+# if __linux__ && __LP64__ && defined(SYS_mmap)
+    return (void *)syscall(SYS_mmap, addr, size, prot, flags, fd, offset);
+# else
+    return mmap(addr, size, prot, flags, fd, offset);
+# endif
+}
+
+int sys_munmap(void *addr, size_t size) {
+# if __linux__ && defined(SYS_munmap)
+    return (int)syscall(SYS_munmap, addr, size);
+# else
+    return munmap(addr, size);
+# endif
+}
+#endif
+
+void *map_memory(size_t size) {
+#if __unix__
+    void *p = sys_mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+#elif _WIN32
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT,
+                        PAGE_READWRITE);
+#else
+    return nullptr;
+#endif
+}
+
+void unmap_memory(void *p, size_t size) {
+#if __unix__
+    sys_munmap(p, size);
+#elif _WIN32
+    (void)size;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    (void)p;
+    (void)size;
+#endif
+}
+
+#if __unix__ && !defined(__FreeBSD__)
+# define HAS_INTERNAL_HEAP 1
+
+// private heap for what mallocvis allocates for itself, so that its strings,
+// tables and plotting neither shift the addresses the program gets nor sit
+// between its blocks in layout:address plots. One range of address space is
+// reserved up front and committed a run at a time; each 64k run holds blocks
+// of one power of two size, looked up from the run on free, and freed blocks
+// go on a list per size. Blocks larger than a run take whole runs, whose
+// pages go back to the kernel while on their list
+struct InternalHeap {
+    static inline size_t const kRunShift = 16;
+    static inline size_t const kMinShift = 4;
+    static inline size_t const kClasses = sizeof(size_t) * 8;
+
+    std::atomic<bool> ready{false};
+    char *base = nullptr;
+    char *limit = nullptr;
+    char *bump = nullptr;
+    uint8_t *run_class = nullptr;
+    void *free_list[kClasses] = {};
+    char *cursor[kClasses] = {};
+    char *run_end[kClasses] = {};
+    std::mutex lock;
+
+    void init(size_t reserve) {
+        size_t run = (size_t)1 << kRunShift;
+        reserve = (reserve + run - 1) & ~(run - 1);
+        if (!reserve) {
+            return;
+        }
+        void *p = sys_mmap(nullptr, reserve + run, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                           0);
+        if (p == MAP_FAILED) {
+            return;
+        }
+        run_class = (uint8_t *)map_memory(reserve >> kRunShift);
+        if (!run_class) {
+            sys_munmap(p, reserve + run);
+            return;
+        }
+        base = (char *)(((uintptr_t)p + run - 1) & ~(uintptr_t)(run - 1));
+        limit = base + reserve;
+        bump = base;
+        ready.store(true, std::memory_order_release);
+    }
+
+    // a plain range check, as every free asks it even while stopped: base
+    // and limit are null until init
+    bool owns(void *ptr) const {
+        return (char *)ptr >= base && (char *)ptr < limit;
+    }
+
+    size_t size_of(void *ptr) const {
+        return (size_t)1 << run_class[((char *)ptr - base) >> kRunShift];
+    }
+
+    // null if not ready or out of reserve, the caller then falls back to
+    // the real allocator
+    void *allocate(size_t size, size_t align = 0) {
+        if (!ready.load(std::memory_order_acquire) ||
+            align > ((size_t)1 << kRunShift)) {
+            return nullptr;
+        }
+        size_t n = std::max(size, align);
+        if (n > (size_t)(limit - base)) {
+            return nullptr;
+        }
+        size_t c = kMinShift;
+        while (((size_t)1 << c) < n) {
+            ++c;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (void *p = free_list[c]) {
+            std::memcpy(&free_list[c], p, sizeof(void *));
+            return p;
+        }
+        if (c > kRunShift) {
+            return take_runs(c, (size_t)1 << (c - kRunShift));
+        }
+        if (cursor[c] == run_end[c]) {
+            char *run = take_runs(c, 1);
+            if (!run) {
+                return nullptr;
+            }
+            cursor[c] = run;
+            run_end[c] = run + ((size_t)1 << kRunShift);
+        }
+        void *p = cursor[c];
+        cursor[c] += (size_t)1 << c;
+        return p;
+    }
+
+    void deallocate(void *ptr) {
+        size_t c = run_class[((char *)ptr - base) >> kRunShift];
+# if __linux__ && defined(SYS_madvise)
+        if (c > kRunShift) {
+            syscall(SYS_madvise, (char *)ptr + 4096, ((size_t)1 << c) - 4096,
+                    MADV_DONTNEED);
+        }
+# endif
+        std::lock_guard<std::mutex> guard(lock);
+        std::memcpy(ptr, &free_list[c], sizeof(void *));
+        free_list[c] = ptr;
+    }
+
+private:
+    char *take_runs(size_t c, size_t runs) {
+        size_t bytes = runs << kRunShift;
+        if ((size_t)(limit - bump) < bytes) {
+            return nullptr;
+        }
+        char *p = bump;
+        if (mprotect(p, bytes, PROT_READ | PROT_WRITE)) {
+            return nullptr;
+        }
+        bump += bytes;
+        run_class[(p - base) >> kRunShift] = (uint8_t)c;
+        return p;
+    }
+};
+
+InternalHeap internal_heap;
+#endif
+
+struct CaptureOptions {
+    // keep only per-callsite totals instead of the event log, written to
+    // report_path (JSON if it ends in .json) on exit or mallocvis_report()
+    bool aggregate = false;
+    std::string report_path = "malloc_report.txt";
+    // live pointers tracked by the aggregate mode to credit frees
+    size_t live_capacity = 1 << 20;
+    size_t thread_buffer_size = 256 * 1024;
+    // time each call into the real allocator
+    bool latency = false;
+    // record the usable size the allocator handed out for each allocation
+    bool usable = false;
+    // record the CPU each heap, resource and region event ran on, read by
+    // rdtscp along with the timestamp under clock:tsc and by getcpu otherwise
+    bool cpu = false;
+    // stamp heap and resource events with Lamport sequence numbers, which
+    // the plotter uses to pair the events of a block exactly; they take about
+    // 2 of the 8 to 10 bytes a default trace spends per event
+    bool sequence = true;
+    // record each thread's start and exit, with its name and creator
+    bool thread_events = true;
+    // serve mallocvis's own allocations from a private arena instead of the
+    // heap being traced, reserving internal_heap_size bytes of address space
+    // for it; what does not fit comes from the traced heap after all
+    bool internal_heap = true;
+    size_t internal_heap_size = sizeof(void *) >= 8 ? (size_t)1 << 30
+                                                    : (size_t)1 << 26;
+    // also trace mmap, munmap, mremap, sbrk, brk and madvise, and under
+    // glibc the program break moved by malloc itself
+    bool mmap = false;
+    // milliseconds between samples of RSS, page faults and glibc's heap
+    // totals, 0 to take none
+    double counter_interval_ms = 0;
+    TraceClockKind clock = TraceClockKind::Monotonic;
+    // mean bytes between sampled allocations, 0 to record every allocation
+    size_t sample_interval = 0;
+    // frames of call stack to record per event, 0 for the caller only
+    size_t stack_depth = 0;
+    bool unwind_frame_pointer = true;
+    // stream the trace to this file or fifo while running instead of
+    // plotting on exit
+    std::string stream_path;
+    // longest time an event may wait in a thread's ring before it is streamed
+    int64_t stream_latency_ms = 50;
+    // bytes of captured events kept in memory besides the per-thread rings,
+    // 0 for no limit
+    size_t memory_limit = 0;
+    // what to do once memory_limit is reached
+    enum class Overflow {
+        Spill, // move everything captured so far to a temporary file
+        Drop,  // drop new events, counting them
+        Stop,  // stop tracing
+    } overflow = Overflow::Spill;
+    // write each thread's events straight into shared file mappings in this
+    // directory, so that they survive a crash; replaces stream
+    std::string trace_dir;
+    size_t segment_size = 4 * 1024 * 1024;
+    // only record allocations within [min_size, max_size], of the op classes
+    // in `ops`, made from the modules whose file names contain one of
+    // `modules`; frees are recorded only for recorded allocations
+    size_t min_size = 0;
+    size_t max_size = (size_t)-1;
+    bool ops_c = true;
+    bool ops_cpp = true;
+    bool ops_cuda = true;
+    bool ops_pmr = true;
+    std::vector<std::string> modules;
+    // begin stopped, waiting for mallocvis_start() or start_signal
+    bool start_manual = false;
+    // begin tracing this many seconds after load, 0 to start right away
+    double start_after = 0;
+    // signals that start and stop tracing, 0 for none
+    int start_signal = 0;
+    int stop_signal = 0;
+};
+
+// accepts a number or a name with or without the SIG prefix, e.g. "USR1"
+int parse_signal(std::string const &k, std::string v) {
+    if (!v.empty() && std::isdigit((unsigned char)v[0])) {
+        int64_t sig = 0;
+        mallocvis_parse_option(k, v, sig);
+        return sig > 0 && sig < 65 ? (int)sig : 0;
+    }
+    if (v.compare(0, 3, "SIG") == 0) {
+        v = v.substr(3);
+    }
+#if __unix__
+    if (v == "USR1") {
+        return SIGUSR1;
+    } else if (v == "USR2") {
+        return SIGUSR2;
+    } else if (v == "HUP") {
+        return SIGHUP;
+    } else if (v == "PROF") {
+        return SIGPROF;
+    }
+#endif
+    return 0;
+}
+
+CaptureOptions parse_capture_options_from_env() {
+    CaptureOptions options;
+    auto env = std::getenv("MALLOCVIS");
+    if (!env) {
+        return options;
+    }
+    // MALLOCVIS holds key:value pairs separated by ';', the capture options
+    // being, with their defaults (see CaptureOptions):
+    //   mode:events              aggregate for per-callsite totals only
+    //   report:malloc_report.txt output of mode:aggregate, JSON if .json
+    //   live_capacity:1m         pointers mode:aggregate tracks for frees
+    //   thread_buffer_size:256k  bytes of each thread's ring
+    //   clock:monotonic          timestamp source, or tsc or coarse
+    //   sample_interval:0        mean bytes between samples, 0 for all
+    //   stack_depth:0            frames recorded per event
+    //   unwind:fp                stack walk by frame pointers, or dwarf
+    //   min_size:0               smallest recorded allocation
+    //   max_size:                largest recorded allocation, if set
+    //   ops:c,cpp,cuda,pmr       families of recorded allocations
+    //   module:                  caller modules recorded, comma separated
+    //   latency:0                time each real allocator call
+    //   usable:0                 record the usable size of blocks
+    //   cpu:0                    record the CPU of each event
+    //   sequence:1               Lamport sequence numbers
+    //   thread_events:1          thread start, exit, name and creator
+    //   mmap:0                   also trace mmap, munmap, brk and the like
+    //   counters:0               ms between RSS and heap samples, 0 for none
+    //   internal_heap:1          serve mallocvis's own allocations apart
+    //   internal_heap_size:1g    address space reserved for them
+    //   stream:                  file or fifo to stream the trace to
+    //   stream_latency:50        ms an event may wait to be streamed
+    //   memory_limit:0           bytes kept besides the rings, 0 for no limit
+    //   overflow:spill           past memory_limit, or drop or stop
+    //   trace_dir:               directory of crash-safe segment files
+    //   segment_size:4m          bytes of each segment file
+    //   start:                   manual to wait for mallocvis_start()
+    //   start_after:0            seconds before tracing starts
+    //   start_signal:            signal that starts tracing, e.g. USR1
+    //   stop_signal:             signal that stops it
+    std::istringstream iss(env);
+    std::string split;
+    while (std::getline(iss, split, ';')) {
+        auto colon = split.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        auto k = split.substr(0, colon);
+        auto v = split.substr(colon + 1);
+        if (k == "mode") {
+            options.aggregate = v == "aggregate";
+        } else if (k == "report") {
+            options.report_path = v;
+        } else if (k == "live_capacity") {
+            mallocvis_parse_option(k, v, options.live_capacity);
+        } else if (k == "thread_buffer_size") {
+            mallocvis_parse_option(k, v, options.thread_buffer_size);
+        } else if (k == "latency") {
+            options.latency = v == "1";
+        } else if (k == "usable") {
+            options.usable = v == "1";
+        } else if (k == "cpu") {
+            options.cpu = v == "1";
+        } else if (k == "sequence") {
+            options.sequence = v == "1";
+        } else if (k == "thread_events") {
+            options.thread_events = v == "1";
+        } else if (k == "internal_heap") {
+            options.internal_heap = v == "1";
+        } else if (k == "internal_heap_size") {
+            mallocvis_parse_option(k, v, options.internal_heap_size);
+        } else if (k == "mmap") {
+            options.mmap = v == "1";
+        } else if (k == "counters") {
+            mallocvis_parse_option(k, v, options.counter_interval_ms);
+        } else if (k == "clock") {
+            if (v == "tsc") {
+                options.clock = TraceClockKind::Tsc;
+            } else if (v == "monotonic") {
+                options.clock = TraceClockKind::Monotonic;
+            } else if (v == "coarse") {
+                options.clock = TraceClockKind::Coarse;
+            }
+        } else if (k == "sample_interval") {
+            mallocvis_parse_option(k, v, options.sample_interval);
+        } else if (k == "stack_depth") {
+            mallocvis_parse_option(k, v, options.stack_depth);
+        } else if (k == "unwind") {
+            if (v == "fp") {
+                options.unwind_frame_pointer = true;
+            } else if (v == "dwarf") {
+                options.unwind_frame_pointer = false;
+            }
+        } else if (k == "stream") {
+            options.stream_path = v;
+        } else if (k == "stream_latency") {
+            mallocvis_parse_option(k, v, options.stream_latency_ms);
+        } else if (k == "memory_limit") {
+            mallocvis_parse_option(k, v, options.memory_limit);
+        } else if (k == "overflow") {
+            if (v == "spill") {
+                options.overflow = CaptureOptions::Overflow::Spill;
+            } else if (v == "drop") {
+                options.overflow = CaptureOptions::Overflow::Drop;
+            } else if (v == "stop") {
+                options.overflow = CaptureOptions::Overflow::Stop;
+            }
+        } else if (k == "trace_dir") {
+            options.trace_dir = v;
+        } else if (k == "segment_size") {
+            mallocvis_parse_option(k, v, options.segment_size);
+        } else if (k == "min_size") {
+            mallocvis_parse_option(k, v, options.min_size);
+        } else if (k == "max_size") {
+            mallocvis_parse_option(k, v, options.max_size);
+        } else if (k == "ops") {
+            options.ops_c = options.ops_cpp = options.ops_cuda =
+                options.ops_pmr = false;
+            std::istringstream ops(v);
+            std::string op;
+            while (std::getline(ops, op, ',')) {
+                options.ops_c |= op == "c";
+                options.ops_cpp |= op == "cpp";
+                options.ops_cuda |= op == "cuda";
+                options.ops_pmr |= op == "pmr";
+            }
+        } else if (k == "module") {
+            std::istringstream modules(v);
+            std::string module;
+            while (std::getline(modules, module, ',')) {
+                options.modules.push_back(module);
+            }
+        } else if (k == "start") {
+            options.start_manual = v == "manual";
+        } else if (k == "start_after") {
+            mallocvis_parse_option(k, v, options.start_after);
+        } else if (k == "start_signal") {
+            options.start_signal = parse_signal(k, v);
+        } else if (k == "stop_signal") {
+            options.stop_signal = parse_signal(k, v);
+        }
+    }
+    return options;
+}
+
+// pointers of recorded allocations still alive while sampling or filtering
+// leaves some out, so that only their frees are recorded. A pointer hashes to
+// a bucket of one cache line and only spills into the following buckets once
+// that is full, which marks the bucket as overflowed; a lookup thus stops at
+// its own bucket unless it ever overflowed, and erased slots are simply
+// cleared instead of left as tombstones. An allocation that fits in none of
+// kMaxBuckets buckets is dropped
+struct RecordedSet {
+    static inline size_t const kBucketSize = 8;
+    static inline size_t const kMaxBuckets = 8;
+
+    std::atomic<uintptr_t> *slots = nullptr;
+    std::atomic<bool> *overflowed = nullptr;
+    size_t mask = 0;
+    // lets the frees of a process with nothing recorded skip the lookup
+    std::atomic<size_t> count{0};
+
+    void init(size_t capacity) {
+        size_t buckets = capacity / kBucketSize;
+        overflowed = (std::atomic<bool> *)map_memory(buckets);
+        if (overflowed) {
+            slots = (std::atomic<uintptr_t> *)map_memory(
+                capacity * sizeof(std::atomic<uintptr_t>));
+        }
+        mask = buckets - 1;
+    }
+
+    size_t hash(uintptr_t key) const {
+        return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ull >> 16) & mask;
+    }
+
+    bool insert(void *ptr) {
+        uintptr_t key = (uintptr_t)ptr;
+        size_t b = hash(key);
+        for (size_t n = 0; n < kMaxBuckets; ++n, b = (b + 1) & mask) {
+            std::atomic<uintptr_t> *bucket = slots + b * kBucketSize;
+            for (size_t j = 0; j < kBucketSize; ++j) {
+                uintptr_t old = 0;
+                if (bucket[j].load(std::memory_order_relaxed) == 0 &&
+                    bucket[j].compare_exchange_strong(
+                        old, key, std::memory_order_relaxed)) {
+                    count.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            if (!overflowed[b].load(std::memory_order_relaxed)) {
+                overflowed[b].store(true, std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+
+    bool erase(void *ptr) {
+        if (!count.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        uintptr_t key = (uintptr_t)ptr;
+        size_t b = hash(key);
+        for (size_t n = 0; n < kMaxBuckets; ++n, b = (b + 1) & mask) {
+            std::atomic<uintptr_t> *bucket = slots + b * kBucketSize;
+            for (size_t j = 0; j < kBucketSize; ++j) {
+                uintptr_t old = key;
+                if (bucket[j].load(std::memory_order_relaxed) == key) {
+                    if (!bucket[j].compare_exchange_strong(
+                            old, 0, std::memory_order_relaxed)) {
+                        return false;
+                    }
+                    count.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            if (!overflowed[b].load(std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+        return false;
+    }
+};
+
+// Lamport clocks for addresses, striped by hash: an event on a block takes
+// a number above both its thread's last one and its stripe's, then raises
+// the stripe to it. The allocator orders a free before the reuse of its
+// block, so the events of one block get increasing numbers however close in
+// time they are; addresses sharing a stripe are merely ordered too
+struct SequenceTable {
+    static inline size_t const kStripes = 1 << 16;
+
+    std::atomic<uint64_t> *stripes = nullptr;
+
+    void init() {
+        stripes = (std::atomic<uint64_t> *)map_memory(
+            kStripes * sizeof(std::atomic<uint64_t>));
+    }
+
+    uint64_t next(uint64_t &thread_clock, void *ptr) {
+        auto &stripe = stripes[(size_t)(((uintptr_t)ptr >> 4) *
+                                        0x9E3779B97F4A7C15ull >> 48)];
+        uint64_t old = stripe.load(std::memory_order_acquire);
+        uint64_t seq;
+        do {
+            seq = std::max(thread_clock, old) + 1;
+        } while (!stripe.compare_exchange_weak(old, seq,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+        thread_clock = seq;
+        return seq;
+    }
+};
+
+// deduplicated call stacks shared by all threads, ids are handed out densely
+// in order of first appearance; a slot is claimed by moving its hash from 0
+// to kWriting, and published by storing the real hash once filled in
+struct StackTable {
+    static inline size_t const kCapacity = 1 << 16;
+    static inline size_t const kMaxProbe = 128;
+    static inline size_t const kMaxDepth = 32;
+    static inline uint64_t const kWriting = 1;
+
+    struct Entry {
+        std::atomic<uint64_t> hash;
+        uint32_t id;
+        uint32_t depth;
+        void *frames[kMaxDepth];
+    };
+
+    Entry *entries = nullptr;
+    std::atomic<uint32_t> *slot_of_id = nullptr;
+    std::atomic<uint32_t> num_stacks{0};
+
+    void init() {
+        entries = (Entry *)map_memory(kCapacity * sizeof(Entry));
+        slot_of_id = (std::atomic<uint32_t> *)map_memory(
+            (kCapacity + 1) * sizeof(std::atomic<uint32_t>));
+    }
+
+    static uint64_t hash(void *const *frames, size_t depth) {
+        uint64_t h = 0xcbf29ce484222325ull ^ depth;
+        for (size_t i = 0; i < depth; ++i) {
+            h = (h ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        return h > kWriting ? h : h + 2;
+    }
+
+    // returns 0 if the table is too crowded to take the stack
+    uint32_t intern(void *const *frames, size_t depth) {
+        uint64_t h = hash(frames, depth);
+        size_t i = (size_t)(h % kCapacity);
+        for (size_t n = 0; n < kMaxProbe; ++n, i = (i + 1) % kCapacity) {
+            Entry &entry = entries[i];
+            uint64_t old = entry.hash.load(std::memory_order_acquire);
+            // losing the race leaves in `old` what the winner wrote, which
+            // may be this very stack, so the slot is compared all the same
+            if (old == 0 && entry.hash.compare_exchange_strong(
+                                old, kWriting, std::memory_order_acquire)) {
+                uint32_t id =
+                    num_stacks.fetch_add(1, std::memory_order_relaxed) + 1;
+                entry.id = id;
+                entry.depth = (uint32_t)depth;
+                std::copy(frames, frames + depth, entry.frames);
+                entry.hash.store(h, std::memory_order_release);
+                slot_of_id[id].store((uint32_t)i + 1,
+                                     std::memory_order_release);
+                return id;
+            }
+            while (old == kWriting) {
+                old = entry.hash.load(std::memory_order_acquire);
+            }
+            if (old == h && entry.depth == depth &&
+                std::equal(frames, frames + depth, entry.frames)) {
+                return entry.id;
+            }
+        }
+        return 0;
+    }
+
+    // calls func(id, frames, depth) for every published stack
+    template <class Func>
+    void for_each(Func &&func) const {
+        uint32_t n = num_stacks.load(std::memory_order_acquire);
+        for (uint32_t id = 1; id <= n; ++id) {
+            uint32_t slot = slot_of_id[id].load(std::memory_order_acquire);
+            if (slot) {
+                Entry const &entry = entries[slot - 1];
+                func(id, entry.frames, (size_t)entry.depth);
+            }
+        }
+    }
+};
+
+// callsites seen by mode:aggregate, ids are handed out densely in order of
+// first appearance; id 0 collects the callsites that did not fit. Live and
+// peak bytes are shared since frees often happen on other threads
+struct CallsiteTable {
+    static inline size_t const kCapacity = 1 << 16;
+    static inline size_t const kMaxProbe = 128;
+    static inline uintptr_t const kWriting = 1;
+
+    struct Slot {
+        std::atomic<uintptr_t> key;
+        uint32_t id;
+    };
+
+    struct Live {
+        std::atomic<int64_t> bytes;
+        std::atomic<int64_t> peak;
+    };
+
+    Slot *slots = nullptr;
+    void **caller_of_id = nullptr;
+    Live *live = nullptr;
+    std::atomic<uint32_t> num_callsites{0};
+
+    void init() {
+        slots = (Slot *)map_memory(kCapacity * sizeof(Slot));
+        caller_of_id = (void **)map_memory(kCapacity * sizeof(void *));
+        live = (Live *)map_memory(kCapacity * sizeof(Live));
+    }
+
+    // keys 0 and kWriting are reserved, so callers are stored shifted by 2
+    uint32_t intern(void *caller) {
+        uintptr_t key = (uintptr_t)caller + 2;
+        size_t i = (size_t)(key * 0x9E3779B97F4A7C15ull >> 16) % kCapacity;
+        for (size_t n = 0; n < kMaxProbe; ++n, i = (i + 1) % kCapacity) {
+            Slot &slot = slots[i];
+            uintptr_t old = slot.key.load(std::memory_order_acquire);
+            if (old == 0 && slot.key.compare_exchange_strong(
+                                old, kWriting, std::memory_order_acquire)) {
+                uint32_t id =
+                    num_callsites.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (id >= kCapacity) {
+                    id = 0;
+                } else {
+                    caller_of_id[id] = caller;
+                }
+                slot.id = id;
+                slot.key.store(key, std::memory_order_release);
+                return id;
+            }
+            while (old == kWriting) {
+                old = slot.key.load(std::memory_order_acquire);
+            }
+            if (old == key) {
+                return slot.id;
+            }
+        }
+        return 0;
+    }
+
+    void add_live(uint32_t id, int64_t delta) {
+        int64_t bytes =
+            live[id].bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+        int64_t peak = live[id].peak.load(std::memory_order_relaxed);
+        while (bytes > peak &&
+               !live[id].peak.compare_exchange_weak(
+                   peak, bytes, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// allocation counts of one thread, indexed by callsite id; only the owning
+// thread writes them, reports read them concurrently
+struct CallsiteCounters {
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> frees;
+    std::atomic<uint64_t> slack;
+
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+};
+
+// live pointer -> (callsite id, size) for mode:aggregate, packed into one
+// word as id << 40 | size. Laid out in buckets of one cache line like
+// RecordedSet, so that freed slots are cleared instead of left as tombstones
+// and a lookup stops at its own bucket unless it ever overflowed; a pointer
+// that fits in none of kMaxBuckets buckets is counted as allocated but never
+// as live
+struct LivePointerTable {
+    static inline size_t const kBucketSize = 4;
+    static inline size_t const kMaxBuckets = 16;
+    static inline uint64_t const kSizeMask = (1ull << 40) - 1;
+
+    struct Slot {
+        std::atomic<uintptr_t> ptr;
+        std::atomic<uint64_t> info;
+    };
+
+    Slot *slots = nullptr;
+    std::atomic<bool> *overflowed = nullptr;
+    size_t mask = 0;
+
+    void init(size_t capacity) {
+        size_t n = 1024;
+        while (n < capacity) {
+            n *= 2;
+        }
+        size_t buckets = n / kBucketSize;
+        overflowed = (std::atomic<bool> *)map_memory(buckets);
+        if (overflowed) {
+            slots = (Slot *)map_memory(n * sizeof(Slot));
+        }
+        mask = buckets - 1;
+    }
+
+    size_t hash(uintptr_t key) const {
+        return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ull >> 16) & mask;
+    }
+
+    bool insert(void *ptr, uint32_t id, size_t size) {
+        uintptr_t key = (uintptr_t)ptr;
+        size_t b = hash(key);
+        for (size_t n = 0; n < kMaxBuckets; ++n, b = (b + 1) & mask) {
+            Slot *bucket = slots + b * kBucketSize;
+            for (size_t j = 0; j < kBucketSize; ++j) {
+                uintptr_t old = 0;
+                if (bucket[j].ptr.load(std::memory_order_relaxed) == 0 &&
+                    bucket[j].ptr.compare_exchange_strong(
+                        old, key, std::memory_order_relaxed)) {
+                    uint64_t info = (uint64_t)id << 40 |
+                                    std::min((uint64_t)size, kSizeMask);
+                    bucket[j].info.store(info, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            if (!overflowed[b].load(std::memory_order_relaxed)) {
+                overflowed[b].store(true, std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+
+    bool erase(void *ptr, uint32_t &id, size_t &size) {
+        uintptr_t key = (uintptr_t)ptr;
+        size_t b = hash(key);
+        for (size_t n = 0; n < kMaxBuckets; ++n, b = (b + 1) & mask) {
+            Slot *bucket = slots + b * kBucketSize;
+            for (size_t j = 0; j < kBucketSize; ++j) {
+                uintptr_t old = key;
+                if (bucket[j].ptr.load(std::memory_order_relaxed) == key) {
+                    uint64_t info =
+                        bucket[j].info.load(std::memory_order_relaxed);
+                    if (!bucket[j].ptr.compare_exchange_strong(
+                            old, 0, std::memory_order_relaxed)) {
+                        return false;
+                    }
+                    id = (uint32_t)(info >> 40);
+                    size = (size_t)(info & kSizeMask);
+                    return true;
+                }
+            }
+            if (!overflowed[b].load(std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+        return false;
+    }
+};
+
+#if __GNUC__ && __unix__
+struct UnwindState {
+    void **frames;
+    size_t depth;
+    size_t max_depth;
+    void *caller;
+    bool found;
+};
+
+_Unwind_Reason_Code unwind_callback(struct _Unwind_Context *context,
+                                    void *arg) {
+    auto state = (UnwindState *)arg;
+    void *pc = (void *)_Unwind_GetIP(context);
+    if (!pc) {
+        return _URC_END_OF_STACK;
+    }
+    if (!state->found) {
+        if (pc != state->caller) {
+            return _URC_NO_REASON;
+        }
+        state->found = true;
+    }
+    state->frames[state->depth++] = pc;
+    return state->depth < state->max_depth ? _URC_NO_REASON
+                                           : _URC_END_OF_STACK;
+}
+#endif
+
+// collects up to max_depth return addresses starting at `caller`, the return
+// address of the hook; frames above it belong to mallocvis and are skipped.
+// A frame pointer walk that comes back shallow means the program was built
+// without them, so use_frame_pointer is then cleared and later calls go
+// straight to the unwinder instead of paying for both walks
+size_t capture_stack(void **frames, size_t max_depth, void *caller,
+                     uintptr_t stack_lo, uintptr_t stack_hi,
+                     bool &use_frame_pointer) {
+    size_t depth = 0;
+#if __GNUC__
+    if (use_frame_pointer) {
+        // walk the frame pointer chain, stopping at the first link that does
+        // not point further up the same stack
+        auto fp = (void **)__builtin_frame_address(0);
+        bool found = false;
+        for (size_t n = 0; n < max_depth + 8 && depth < max_depth; ++n) {
+            if ((uintptr_t)fp < stack_lo || (uintptr_t)fp >= stack_hi ||
+                ((uintptr_t)fp & (sizeof(void *) - 1))) {
+                break;
+            }
+            void *pc = fp[1];
+            if (!pc) {
+                break;
+            }
+            if (!found && pc == caller) {
+                found = true;
+            }
+            if (found) {
+                frames[depth++] = pc;
+            }
+            auto next = (void **)fp[0];
+            if (next <= fp) {
+                break;
+            }
+            fp = next;
+        }
+        if (depth > 1 || max_depth <= 1) {
+            return depth;
+        }
+        use_frame_pointer = false;
+    }
+#endif
+#if __GNUC__ && __unix__
+    UnwindState state{frames, 0, max_depth, caller, false};
+    _Unwind_Backtrace(unwind_callback, &state);
+    depth = state.depth;
+#elif _WIN32
+    void *all[StackTable::kMaxDepth + 8];
+    size_t n = CaptureStackBackTrace(0, (DWORD)(max_depth + 8), all, nullptr);
+    size_t i = 0;
+    while (i < n && all[i] != caller) {
+        ++i;
+    }
+    for (; i < n && depth < max_depth; ++i) {
+        frames[depth++] = all[i];
+    }
+#endif
+    if (!depth) {
+        frames[depth++] = caller;
+    }
+    return depth;
+}
+
+// fixed-size piece of a thread's collected stream, chunks are recycled
+// through GlobalData::free_chunks and never unmapped while tracing
+struct Chunk {
+    static constexpr size_t kMapSize = 64 * 1024;
+    static constexpr size_t kCapacity = kMapSize - 2 * sizeof(void *);
+
+    Chunk *next;
+    size_t size;
+    unsigned char data[kCapacity];
+};
+
+static_assert(sizeof(Chunk) == Chunk::kMapSize, "chunk must fill its map");
+
+// bytes drained from a ring, in order; a record may straddle two chunks
+struct ChunkList {
+    Chunk *first = nullptr;
+    Chunk *last = nullptr;
+
+    bool empty() const {
+        return !first;
+    }
+
+    void push_back(Chunk *chunk) {
+        chunk->next = nullptr;
+        chunk->size = 0;
+        (last ? last->next : first) = chunk;
+        last = chunk;
+    }
+
+    // detaches all chunks, returning the first
+    Chunk *release() {
+        Chunk *chunk = first;
+        first = last = nullptr;
+        return chunk;
+    }
+};
+
+// single-producer single-consumer byte ring of encoded actions, the owning
+// thread pushes without any lock, consumers take GlobalData::lock before
+// draining it into `collected`
+struct alignas(64) PerThreadData {
+    alignas(64) std::atomic<size_t> head{0};
+    size_t cached_tail = 0;
+    uint32_t tid = 0;
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t ring_mask;
+    size_t map_size;
+    uint32_t index;
+    PerThreadData *next = nullptr;
+    std::atomic<bool> owned{true};
+    unsigned char *ring;
+    ChunkList collected;
+    // events dropped by the owning thread since the memory limit was reached,
+    // the next event pushed restarts the stream
+    uint64_t dropped = 0;
+    bool resync = false;
+    // set once make_room failed; until a chunk is recycled or the ring
+    // drains, events are counted as dropped without being encoded
+    bool dropping = false;
+    uint64_t drop_generation = 0;
+    size_t drop_tail = 0;
+    int64_t bytes_until_sample = 0;
+    uint64_t rng_state = 0;
+    // this thread's Lamport clock, see SequenceTable
+    uint64_t seq_clock = 0;
+    uintptr_t stack_lo = 0;
+    uintptr_t stack_hi = (uintptr_t)-1;
+    // unwind:fp until a walk of this thread's stack came back shallow
+    bool use_frame_pointer = true;
+    // with trace_dir, events are appended to this mapped segment instead of
+    // the ring, `head` is then the committed length
+    bool segmented = false;
+    // per-callsite counts under mode:aggregate
+    CallsiteCounters *counters = nullptr;
+    TraceSegmentHeader *segment = nullptr;
+    size_t segment_capacity = 0;
+    uint64_t segment_sequence = 0;
+    uint64_t segment_bytes = 0;
+    AllocActionEncoder encoder;
+
+    static PerThreadData *create(size_t buffer_size) {
+        size_t ring_size = 4096;
+        while (ring_size * 2 <= buffer_size) {
+            ring_size *= 2;
+        }
+        size_t map_size = sizeof(PerThreadData) + ring_size;
+        void *p = map_memory(map_size);
+        if (!p) {
+            return nullptr;
+        }
+        auto per_thread = new (p) PerThreadData;
+        per_thread->ring_mask = ring_size - 1;
+        per_thread->map_size = map_size;
+        per_thread->ring = (unsigned char *)(per_thread + 1);
+        return per_thread;
+    }
+
+    bool push(unsigned char const *data, size_t size) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (segmented) {
+            if (h + size > segment_capacity) {
+                return false;
+            }
+            std::memcpy(ring + h, data, size);
+            head.store(h + size, std::memory_order_relaxed);
+            segment->committed.store(h + size, std::memory_order_release);
+            return true;
+        }
+        if (h + size - cached_tail > ring_mask + 1) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h + size - cached_tail > ring_mask + 1) {
+                return false;
+            }
+        }
+        size_t offset = h & ring_mask;
+        size_t first = std::min(size, ring_mask + 1 - offset);
+        std::memcpy(ring + offset, data, first);
+        std::memcpy(ring, data + first, size - first);
+        head.store(h + size, std::memory_order_release);
+        return true;
+    }
+
+    // pending bytes as at most two contiguous pieces, which stay valid until
+    // release(head) hands the space back to the producer
+    struct Pending {
+        unsigned char const *data[2];
+        size_t size[2];
+        size_t head;
+    };
+
+    Pending peek() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        size_t offset = t & ring_mask;
+        size_t first = std::min(h - t, ring_mask + 1 - offset);
+        return {{ring + offset, ring}, {first, h - t - first}, h};
+    }
+
+    void release(size_t h) {
+        tail.store(h, std::memory_order_release);
+    }
+
+    // calls func(data, size) for the at most two contiguous pieces pending
+    template <class Func>
+    void drain(Func &&func) {
+        Pending pending = peek();
+        for (int i = 0; i < 2; ++i) {
+            if (pending.size[i]) {
+                func(pending.data[i], pending.size[i]);
+            }
+        }
+        release(pending.head);
+    }
+
+    // fill level as last seen by the producer, refreshed once it looks high
+    bool more_than_half_full(size_t h) {
+        size_t half = (ring_mask + 1) / 2;
+        if (h - cached_tail <= half) {
+            return false;
+        }
+        cached_tail = tail.load(std::memory_order_acquire);
+        return h - cached_tail > half;
+    }
+};
+
+// lets producers wake the exporter as soon as a ring is half full, the
+// exporter otherwise sleeps until its latency deadline
+struct Wakeup {
+    std::atomic<uint32_t> seq{0};
+    std::atomic<bool> waiting{false};
+
+    void notify() {
+        if (!waiting.load(std::memory_order_relaxed) ||
+            !waiting.exchange(false, std::memory_order_acq_rel)) {
+            return;
+        }
+        seq.fetch_add(1, std::memory_order_release);
+#if __linux__
+        syscall(SYS_futex, &seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    void wait(int64_t timeout_ns) {
+        uint32_t old = seq.load(std::memory_order_acquire);
+        waiting.store(true, std::memory_order_seq_cst);
+#if __linux__
+        timespec ts{(time_t)(timeout_ns / 1000000000),
+                    (long)(timeout_ns % 1000000000)};
+        syscall(SYS_futex, &seq, FUTEX_WAIT_PRIVATE, old, &ts, nullptr, 0);
+#else
+        std::this_thread::sleep_for(std::chrono::nanoseconds(timeout_ns));
+#endif
+        waiting.store(false, std::memory_order_relaxed);
+    }
+};
+
+#if __unix__
+using TraceIoVec = iovec;
+#else
+struct TraceIoVec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+// output of the streaming exporter, each batch goes out in as few writev
+// calls as IOV_MAX allows
+struct TraceOutput {
+#if __unix__
+    int fd;
+
+    explicit TraceOutput(std::string const &path)
+        : fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644)) {}
+
+    void write(TraceIoVec *iov, size_t n) {
+        while (n && fd != -1) {
+            ssize_t r = ::writev(fd, iov, (int)std::min(n, (size_t)IOV_MAX));
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            size_t written = (size_t)r;
+            while (n && written >= iov->iov_len) {
+                written -= iov->iov_len;
+                ++iov;
+                --n;
+            }
+            if (n) {
+                iov->iov_base = (char *)iov->iov_base + written;
+                iov->iov_len -= written;
+            }
+        }
+    }
+
+    bool ok() const {
+        return fd != -1;
+    }
+
+    ~TraceOutput() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+#else
+    std::ofstream out;
+
+    explicit TraceOutput(std::string const &path)
+        : out(path, std::ios::binary) {}
+
+    bool ok() const {
+        return out.is_open();
+    }
+
+    void write(TraceIoVec *iov, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out.write((char const *)iov[i].iov_base, iov[i].iov_len);
+        }
+        out.flush();
+    }
+#endif
+
+    void write(void const *data, size_t size) {
+        TraceIoVec iov{(void *)data, size};
+        write(&iov, 1);
+    }
+};
+
+struct GlobalData;
+GlobalData *global = nullptr;
+
+// usable size of a block from the underlying allocator, 0 if unknown
+size_t real_usable_size(void *ptr) noexcept;
+
+// set while the current thread is inside a hook, so that allocations made by
+// the real allocator or by mallocvis itself are not recorded
+thread_local bool in_hook = false;
+
+// set while a hook entered with in_hook set runs, i.e. for the allocations
+// mallocvis makes for itself, which the real allocator then serves from the
+// internal heap
+thread_local bool internal_call = false;
+
+// threads with internal_call set, so that the real allocator only reads the
+// thread-local while some thread may be allocating for mallocvis
+std::atomic<uint32_t> internal_calls{0};
+
+inline bool in_internal_call() {
+    return internal_calls.load(std::memory_order_relaxed) && internal_call;
+}
+
+// serves the current thread's allocations from the internal heap for its
+// scope, for mallocvis's own work outside of hooks
+struct InternalScope {
+    bool entered = false;
+
+    InternalScope() {
+        if (!internal_call) {
+            internal_call = entered = true;
+            internal_calls.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    ~InternalScope() {
+        if (entered) {
+            internal_call = false;
+            internal_calls.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// the first thing every hook checks, so that while stopped a hook costs one
+// relaxed load and branch; false until GlobalData is ready and after it died
+std::atomic<bool> tracing{false};
+
+struct GlobalData {
+    std::mutex lock;
+
+    CaptureOptions options = parse_capture_options_from_env();
+    // every buffer ever created, buffers of exited threads are recycled
+    std::atomic<PerThreadData *> per_threads{nullptr};
+    std::atomic<uint32_t> num_per_threads{0};
+    TraceClockCalibration clock;
+    RecordedSet recorded;
+    SequenceTable sequences;
+    bool aggregating = false;
+    CallsiteTable callsites;
+    LivePointerTable live_pointers;
+    std::atomic<uint64_t> untracked_pointers{0};
+    // region events are recorded, last_brk is the program break as of the
+    // last one, watched after every hook where glibc moves it on its own
+    bool regions = false;
+    bool watch_brk = false;
+    bool thread_events = false;
+    // cpu:1 is in effect, and rdtscp reads the CPU along with the TSC
+    bool record_cpu = false;
+    bool cpu_from_tscp = false;
+    std::atomic<uintptr_t> last_brk{0};
+    // set when filters or sampling leave allocations out, so that frees must
+    // be checked against `recorded`
+    bool tracking = false;
+    bool filtering = false;
+    bool op_allowed[(size_t)AllocOp::Unknown + 1];
+    // executable address ranges of the modules named in options.modules
+    static constexpr size_t kMaxModuleRanges = 32;
+    uintptr_t module_lo[kMaxModuleRanges];
+    uintptr_t module_hi[kMaxModuleRanges];
+    size_t num_module_ranges = 0;
+    StackTable stacks;
+    // names given to mallocvis::Scope and mallocvis_marker(), tag id i names
+    // tag_names[i - 1]; a deque keeps the interned strings in place
+    std::mutex tag_lock;
+    std::unordered_map<std::string, uint32_t> tag_ids;
+    std::deque<std::string> tag_names;
+    // names given to unnamed mallocvis::tracing_resource instances
+    std::atomic<uint32_t> unnamed_resources{0};
+
+    // chunk pool for `collected`, guarded by `lock`
+    Chunk *free_chunks = nullptr;
+    // bumped whenever chunks go back to the pool, see start_dropping
+    std::atomic<uint64_t> chunks_recycled{0};
+    size_t mapped_chunks = 0;
+    size_t max_chunks = 0;
+    // frames of chunks moved out of memory under Overflow::Spill
+    std::string spill_path;
+    std::unique_ptr<TraceOutput> spill;
+    size_t spilled_bytes = 0;
+    // set by overflow() under lock, read by start() from signal handlers
+    std::atomic<bool> overflow_stopped{false};
+
+    bool export_plot_on_exit = true;
+    bool streaming = false;
+    bool segmented = false;
+#if HAS_THREADS
+    std::thread export_thread;
+#endif
+    std::atomic<bool> exiting{false};
+    std::atomic<bool> exporter_ready{false};
+    Wakeup wakeup;
+    // batches requested by mallocvis_flush() and written by the exporter
+    std::atomic<uint64_t> flush_requested{0};
+    std::atomic<uint64_t> flush_done{0};
+#if HAS_THREADS
+    std::thread start_thread;
+    std::mutex start_lock;
+    std::condition_variable start_cv;
+    // also woken through start_cv on exit
+    std::thread sampler_thread;
+#endif
+    // the traced process this one was forked from, 0 if none; outputs of a
+    // forked process are named by its pid so that they do not clobber the
+    // parent's, see mallocvis_output_path
+    uint32_t parent_pid = 0;
+    uint32_t forking_pid = 0;
+    bool forking_in_hook = false;
+
+    GlobalData() {
+#if HAS_INTERNAL_HEAP
+        if (options.internal_heap) {
+            internal_heap.init(options.internal_heap_size);
+        }
+#endif
+        clock.kind = options.clock;
+        if (clock.kind == TraceClockKind::Tsc && !trace_clock_has_tsc()) {
+            clock.kind = TraceClockKind::Monotonic;
+        }
+        calibrate(0);
+        init_filters();
+        if (options.aggregate) {
+            callsites.init();
+            live_pointers.init(options.live_capacity);
+            aggregating = callsites.slots && callsites.caller_of_id &&
+                          callsites.live && live_pointers.slots;
+        }
+        regions = options.mmap && !aggregating;
+        thread_events = options.thread_events && !aggregating;
+        record_cpu = options.cpu && !aggregating;
+        cpu_from_tscp = record_cpu && clock.kind == TraceClockKind::Tsc &&
+                        trace_clock_has_rdtscp();
+#if __linux__ && __GLIBC__
+        if (regions) {
+            last_brk.store((uintptr_t)sbrk(0), std::memory_order_relaxed);
+            watch_brk = true;
+        }
+#endif
+        if (aggregating) {
+            options.sample_interval = 0;
+            options.stream_path.clear();
+            options.trace_dir.clear();
+            export_plot_on_exit = false;
+        } else if (options.sample_interval || filtering) {
+            recorded.init(filtering ? 1 << 20 : 1 << 16);
+            tracking = recorded.slots != nullptr;
+            if (!tracking) {
+                options.sample_interval = 0;
+                filtering = false;
+            }
+        }
+        if (options.sequence && !aggregating) {
+            sequences.init();
+        }
+        if (options.memory_limit) {
+            max_chunks = std::max(options.memory_limit / Chunk::kMapSize,
+                                  (size_t)4);
+        }
+        options.stack_depth =
+            std::min(options.stack_depth, StackTable::kMaxDepth);
+        if (options.stack_depth) {
+            stacks.init();
+            if (!stacks.entries || !stacks.slot_of_id) {
+                options.stack_depth = 0;
+            }
+        }
+#if __unix__
+        pthread_atfork(
+            [] {
+                if (global) {
+                    global->before_fork();
+                }
+            },
+            [] {
+                if (global) {
+                    global->after_fork(false);
+                }
+            },
+            [] {
+                if (global) {
+                    global->after_fork(true);
+                }
+            });
+        if (!options.trace_dir.empty()) {
+            options.trace_dir = mallocvis_output_path(options.trace_dir, false);
+            mkdir(options.trace_dir.c_str(), 0755);
+            options.segment_size =
+                std::max(options.segment_size, 2 * TraceSegmentHeader::kSize);
+            segmented = true;
+            options.stream_path.clear();
+        }
+#endif
+#if HAS_THREADS
+        if (!options.stream_path.empty()) {
+            streaming = true;
+            export_plot_on_exit = false;
+            export_thread = std::thread([this] {
+                export_thread_entry();
+            });
+        }
+#endif
+#if __unix__
+        install_signal(options.start_signal, [](int) {
+            if (global) {
+                global->start();
+            }
+        });
+        install_signal(options.stop_signal, [](int) {
+            tracing.store(false, std::memory_order_relaxed);
+        });
+#endif
+#if HAS_THREADS
+        if (options.counter_interval_ms > 0 && !aggregating) {
+            sampler_thread = std::thread([this] {
+                sampler_thread_entry();
+            });
+        }
+        if (options.start_after > 0 && !options.start_manual) {
+            start_thread = std::thread([this] {
+                in_hook = true;
+                std::unique_lock<std::mutex> guard(start_lock);
+                if (!start_cv.wait_for(
+                        guard,
+                        std::chrono::duration<double>(options.start_after),
+                        [this] {
+                            return exiting.load(std::memory_order_relaxed);
+                        })) {
+                    start();
+                }
+            });
+            return;
+        }
+#endif
+        if (!options.start_manual) {
+            start();
+        }
+    }
+
+    void init_filters() {
+        for (size_t op = 0; op <= (size_t)AllocOp::Unknown; ++op) {
+            op_allowed[op] = (options.ops_c || !kAllocOpIsC[op]) &&
+                             (options.ops_cpp || !kAllocOpIsCpp[op]) &&
+                             (options.ops_cuda || !kAllocOpIsCuda[op]) &&
+                             (options.ops_pmr || !kAllocOpIsResource[op]);
+        }
+        filtering = options.min_size || options.max_size != (size_t)-1 ||
+                    !options.ops_c || !options.ops_cpp || !options.ops_cuda ||
+                    !options.ops_pmr || !options.modules.empty();
+#if HAS_DL_ITERATE_PHDR
+        // modules loaded later by dlopen are not covered
+        if (!options.modules.empty()) {
+            dl_iterate_phdr(
+                [](dl_phdr_info *info, size_t, void *data) -> int {
+                    auto self = (GlobalData *)data;
+                    char const *name = info->dlpi_name;
+                    char const *base = std::strrchr(name, '/');
+                    base = base ? base + 1 : name;
+                    bool match = false;
+                    for (auto const &module: self->options.modules) {
+                        if (module == "main") {
+                            match |= !*name;
+                        } else {
+                            match |= std::strstr(base, module.c_str()) != 0;
+                        }
+                    }
+                    for (int i = 0; match && i < info->dlpi_phnum; ++i) {
+                        auto const &phdr = info->dlpi_phdr[i];
+                        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) &&
+                            self->num_module_ranges < kMaxModuleRanges) {
+                            uintptr_t lo = info->dlpi_addr + phdr.p_vaddr;
+                            self->module_lo[self->num_module_ranges] = lo;
+                            self->module_hi[self->num_module_ranges++] =
+                                lo + phdr.p_memsz;
+                        }
+                    }
+                    return 0;
+                },
+                this);
+        }
+#endif
+        if (!options.modules.empty() && !num_module_ranges) {
+            std::cerr << "mallocvis: no loaded module matches the module "
+                         "filter, nothing will be recorded\n";
+        }
+    }
+
+    bool passes_filters(size_t size, void *caller) const {
+        if (size < options.min_size || size > options.max_size) {
+            return false;
+        }
+        if (options.modules.empty()) {
+            return true;
+        }
+        for (size_t i = 0; i < num_module_ranges; ++i) {
+            if ((uintptr_t)caller - module_lo[i] <
+                module_hi[i] - module_lo[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // bytes handed out beyond `size` for a heap allocation under usable:1
+    uint64_t slack_of(AllocOp op, void *ptr, size_t size) const {
+        if (!options.usable ||
+            !(kAllocOpIsC[(size_t)op] || kAllocOpIsCpp[(size_t)op])) {
+            return 0;
+        }
+        size_t usable = real_usable_size(ptr);
+        return usable > size ? usable - size : 0;
+    }
+
+    void aggregate(PerThreadData &per_thread, AllocOp op, void *ptr,
+                   size_t size, void *caller) {
+        if (kAllocOpIsAllocation[(size_t)op]) {
+            uint32_t id = callsites.intern(caller);
+            CallsiteCounters &counters = per_thread.counters[id];
+            CallsiteCounters::bump(counters.allocs, 1);
+            CallsiteCounters::bump(counters.bytes, size);
+            CallsiteCounters::bump(counters.slack, slack_of(op, ptr, size));
+            if (live_pointers.insert(ptr, id, size)) {
+                callsites.add_live(id, (int64_t)size);
+            } else {
+                untracked_pointers.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else {
+            uint32_t id;
+            if (live_pointers.erase(ptr, id, size)) {
+                CallsiteCounters::bump(per_thread.counters[id].frees, 1);
+                callsites.add_live(id, -(int64_t)size);
+            }
+        }
+    }
+
+    // merges the per-thread counters into one row per callsite, sorted by
+    // bytes allocated
+    void write_report(std::string const &path) {
+        struct Row {
+            void *caller;
+            uint64_t allocs = 0;
+            uint64_t bytes = 0;
+            uint64_t frees = 0;
+            uint64_t slack = 0;
+            int64_t live = 0;
+            int64_t peak = 0;
+        };
+
+        size_t num_ids = std::min(
+            (size_t)callsites.num_callsites.load(std::memory_order_acquire) + 1,
+            CallsiteTable::kCapacity);
+        std::vector<Row> rows(num_ids);
+        for (size_t id = 0; id < num_ids; ++id) {
+            rows[id].caller = id ? callsites.caller_of_id[id] : nullptr;
+            rows[id].live =
+                callsites.live[id].bytes.load(std::memory_order_relaxed);
+            rows[id].peak =
+                callsites.live[id].peak.load(std::memory_order_relaxed);
+        }
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            for (size_t id = 0; id < num_ids; ++id) {
+                auto const &counters = per_thread->counters[id];
+                auto &row = rows[id];
+                row.allocs += counters.allocs.load(std::memory_order_relaxed);
+                row.bytes += counters.bytes.load(std::memory_order_relaxed);
+                row.frees += counters.frees.load(std::memory_order_relaxed);
+                row.slack += counters.slack.load(std::memory_order_relaxed);
+            }
+        }
+        rows.erase(std::remove_if(rows.begin(), rows.end(),
+                                  [](Row const &row) {
+                                      return !row.allocs;
+                                  }),
+                   rows.end());
+        std::sort(rows.begin(), rows.end(), [](Row const &a, Row const &b) {
+            return a.bytes > b.bytes;
+        });
+
+        std::cerr << "Writing report of " << rows.size() << " callsites to "
+                  << path << "...\n";
+        std::ofstream out(path);
+        bool json = path.size() >= 5 && path.substr(path.size() - 5) == ".json";
+        if (json) {
+            out << "[\n";
+        } else {
+            out << "allocs\tbytes\tslack\tfrees\tlive\tpeak\tcaller\n";
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            auto const &row = rows[i];
+            std::string sym = row.caller ? addr2sym(row.caller) : "(other)";
+            if (json) {
+                std::string escaped;
+                for (char c: sym) {
+                    if (c == '"' || c == '\\') {
+                        escaped += '\\';
+                    }
+                    escaped += c;
+                }
+                out << "  {\"caller\": \"" << escaped
+                    << "\", \"address\": " << (uintptr_t)row.caller
+                    << ", \"allocs\": " << row.allocs
+                    << ", \"bytes\": " << row.bytes
+                    << ", \"slack\": " << row.slack
+                    << ", \"frees\": " << row.frees
+                    << ", \"live\": " << row.live
+                    << ", \"peak\": " << row.peak << "}"
+                    << (i + 1 < rows.size() ? ",\n" : "\n");
+            } else {
+                out << row.allocs << '\t' << row.bytes << '\t' << row.slack
+                    << '\t' << row.frees << '\t' << row.live << '\t'
+                    << row.peak << '\t' << sym << '\n';
+            }
+        }
+        if (json) {
+            out << "]\n";
+        }
+        uint64_t untracked = untracked_pointers.load(std::memory_order_relaxed);
+        if (untracked) {
+            std::cerr << untracked << " allocations did not fit live_capacity, "
+                      << "their frees were not counted\n";
+        }
+    }
+
+    // async-signal-safe, as it only touches lock-free atomics
+    void start() {
+        if (exiting.load(std::memory_order_acquire) ||
+            overflow_stopped.load(std::memory_order_acquire)) {
+            return;
+        }
+        tracing.store(true);
+        // overflow() may have stopped tracing since the check above
+        if (overflow_stopped.load()) {
+            tracing.store(false, std::memory_order_release);
+        }
+    }
+
+    void stop() {
+        tracing.store(false, std::memory_order_release);
+    }
+
+    std::string output_path(std::string const &path) const {
+        return mallocvis_output_path(path, parent_pid != 0);
+    }
+
+#if __unix__
+    // takes every lock, so that the child does not inherit one held by a
+    // thread that no longer exists there; the forking thread records nothing
+    // until after_fork
+    void before_fork() {
+        forking_in_hook = in_hook;
+        in_hook = true;
+        forking_pid = get_process_id();
+        lock.lock();
+        tag_lock.lock();
+# if HAS_THREADS
+        start_lock.lock();
+# endif
+# if HAS_INTERNAL_HEAP
+        internal_heap.lock.lock();
+# endif
+    }
+
+    void after_fork(bool child) {
+# if HAS_INTERNAL_HEAP
+        internal_heap.lock.unlock();
+# endif
+# if HAS_THREADS
+        start_lock.unlock();
+# endif
+        tag_lock.unlock();
+        lock.unlock();
+        if (child) {
+            parent_pid = forking_pid;
+            reset_after_fork();
+        }
+        in_hook = forking_in_hook;
+    }
+
+    void reset_after_fork();
+#endif
+
+#if __unix__
+    static void install_signal(int sig, void (*handler)(int)) {
+        if (sig <= 0) {
+            return;
+        }
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(sig, &action, nullptr);
+    }
+#endif
+
+    // makes everything captured so far visible to the output: the exporter
+    // writes a batch while streaming, otherwise the rings are drained into
+    // chunks; segments are always up to date
+    void flush() {
+        if (segmented) {
+            return;
+        }
+#if HAS_THREADS
+        if (streaming) {
+            uint64_t request =
+                flush_requested.fetch_add(1, std::memory_order_acq_rel) + 1;
+            while (exporter_ready.load(std::memory_order_acquire) &&
+                   flush_done.load(std::memory_order_acquire) < request) {
+                wakeup.notify();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return;
+        }
+#endif
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            collect(*per_thread);
+        }
+    }
+
+    int64_t now() const {
+        switch (clock.kind) {
+        case TraceClockKind::Tsc:    return trace_clock_tsc();
+        case TraceClockKind::Coarse: return trace_clock_coarse();
+        default:                     return trace_clock_monotonic();
+        }
+    }
+
+    // the time, and with cpu:1 the CPU plus one in `cpu`, or else 0
+    int64_t now(uint32_t &cpu) const {
+        cpu = 0;
+        if (!record_cpu) {
+            return now();
+        }
+        if (cpu_from_tscp) {
+            int64_t ticks = trace_clock_tscp(cpu);
+            ++cpu;
+            return ticks;
+        }
+        cpu = get_cpu_id() + 1;
+        return now();
+    }
+
+    // the calibration from the start of capture until now
+    TraceClockCalibration clock_so_far() const {
+        TraceClockCalibration so_far = clock;
+        so_far.ticks[1] = now();
+        so_far.ns[1] = trace_clock_monotonic();
+        return so_far;
+    }
+
+    void calibrate(int i) {
+        clock.ticks[i] = now();
+        clock.ns[i] = trace_clock_monotonic();
+    }
+
+    PerThreadData *register_thread() {
+        PerThreadData *per_thread = acquire_thread();
+        if (per_thread) {
+            unsigned char buf[kCodecMaxRecordSize];
+            per_thread->tid = get_thread_id();
+            per_thread->rng_state =
+                ((uint64_t)per_thread->tid * 0x9E3779B97F4A7C15ull ^
+                 (uint64_t)now()) |
+                1;
+            per_thread->bytes_until_sample = next_sample_distance(*per_thread);
+            get_stack_bounds(*per_thread);
+            per_thread->use_frame_pointer = options.unwind_frame_pointer;
+            size_t n = per_thread->encoder.begin(buf, per_thread->tid);
+            while (!per_thread->push(buf, n)) {
+                if (!make_room(*per_thread)) {
+                    per_thread->resync = true;
+                    break;
+                }
+            }
+        }
+        return per_thread;
+    }
+
+    // exponentially distributed bytes until the next sample, which makes the
+    // sampled points a Poisson process over allocated bytes
+    int64_t next_sample_distance(PerThreadData &per_thread) const {
+        if (!options.sample_interval) {
+            return 0;
+        }
+        uint64_t &x = per_thread.rng_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        double u =
+            (double)(((x * 0x2545F4914F6CDD1Dull) >> 11) + 1) * 0x1.0p-53;
+        double distance = -std::log(u) * (double)options.sample_interval;
+        return std::max((int64_t)distance, (int64_t)1);
+    }
+
+    // called once the countdown has run out on an allocation of `size`,
+    // returns the number of bytes it stands for
+    uint64_t take_sample(PerThreadData &per_thread, size_t size) {
+        per_thread.bytes_until_sample = next_sample_distance(per_thread);
+        double interval = (double)options.sample_interval;
+        double p = -std::expm1(-(double)size / interval);
+        if (p <= 0) {
+            return options.sample_interval;
+        }
+        return std::max((uint64_t)((double)size / p + 0.5), (uint64_t)1);
+    }
+
+    void get_stack_bounds(PerThreadData &per_thread) const {
+        per_thread.stack_lo = 0;
+        per_thread.stack_hi = (uintptr_t)-1;
+#if __linux__ && __GLIBC__
+        pthread_attr_t attr;
+        if (options.stack_depth && !pthread_getattr_np(pthread_self(), &attr)) {
+            void *addr;
+            size_t size;
+            if (!pthread_attr_getstack(&attr, &addr, &size)) {
+                per_thread.stack_lo = (uintptr_t)addr;
+                per_thread.stack_hi = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+#endif
+    }
+
+    uint32_t capture_stack_id(PerThreadData &per_thread, void *caller) {
+        void *frames[StackTable::kMaxDepth];
+        size_t depth = capture_stack(frames, options.stack_depth, caller,
+                                     per_thread.stack_lo, per_thread.stack_hi,
+                                     per_thread.use_frame_pointer);
+        return stacks.intern(frames, depth);
+    }
+
+    std::vector<std::vector<void *>> stack_frames() const {
+        std::vector<std::vector<void *>> result;
+        if (options.stack_depth) {
+            result.resize(stacks.num_stacks.load(std::memory_order_acquire) +
+                          1);
+            stacks.for_each([&](uint32_t id, void *const *frames,
+                                size_t depth) {
+                if (id < result.size()) {
+                    result[id].assign(frames, frames + depth);
+                }
+            });
+        }
+        return result;
+    }
+
+    PerThreadData *acquire_thread() {
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            bool expected = false;
+            if (!per_thread->owned.load(std::memory_order_relaxed) &&
+                per_thread->owned.compare_exchange_strong(
+                    expected, true, std::memory_order_acquire)) {
+                return per_thread;
+            }
+        }
+        auto per_thread = PerThreadData::create(
+            segmented || aggregating ? 0 : options.thread_buffer_size);
+        if (!per_thread) {
+            return nullptr;
+        }
+        if (aggregating) {
+            per_thread->counters = (CallsiteCounters *)map_memory(
+                CallsiteTable::kCapacity * sizeof(CallsiteCounters));
+            if (!per_thread->counters) {
+                return nullptr;
+            }
+        }
+        per_thread->segmented = segmented;
+        per_thread->index =
+            num_per_threads.fetch_add(1, std::memory_order_relaxed);
+        per_thread->next = per_threads.load(std::memory_order_relaxed);
+        while (!per_threads.compare_exchange_weak(per_thread->next, per_thread,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+        }
+        return per_thread;
+    }
+
+    // a released ring keeps its pending bytes, the exporter still finds it
+    // through per_threads and the next owner starts a fresh stream in it
+    void release_thread(PerThreadData *per_thread) {
+        if (!streaming && !segmented) {
+            collect(*per_thread);
+        } else if (streaming) {
+            // write out the last events now rather than at the next tick
+            wakeup.notify();
+        }
+        per_thread->owned.store(false, std::memory_order_release);
+    }
+
+    // called when a ring is full; while streaming, give the exporter a few
+    // chances to write it out before falling back to `collected`, which it
+    // streams later as well; returns false if the memory limit leaves no room
+    bool make_room(PerThreadData &per_thread) {
+        if (segmented) {
+            return next_segment(per_thread);
+        }
+        if (streaming && exporter_ready.load(std::memory_order_acquire)) {
+            size_t t = per_thread.tail.load(std::memory_order_acquire);
+            for (int i = 0; i < 64; ++i) {
+                wakeup.notify();
+                std::this_thread::yield();
+                if (per_thread.tail.load(std::memory_order_acquire) != t) {
+                    return true;
+                }
+            }
+        }
+        return collect(per_thread);
+    }
+
+    // remembers what the failed make_room saw, so that the thread can tell
+    // with two loads whether trying again has any chance; a segment that
+    // could not be mapped is retried on every event instead
+    void start_dropping(PerThreadData &per_thread) {
+        if (segmented) {
+            return;
+        }
+        per_thread.dropping = true;
+        per_thread.drop_generation =
+            chunks_recycled.load(std::memory_order_relaxed);
+        per_thread.drop_tail = per_thread.tail.load(std::memory_order_relaxed);
+    }
+
+    bool may_have_room(PerThreadData const &per_thread) const {
+        return chunks_recycled.load(std::memory_order_relaxed) !=
+                   per_thread.drop_generation ||
+               per_thread.tail.load(std::memory_order_relaxed) !=
+                   per_thread.drop_tail;
+    }
+
+    void after_push(PerThreadData &per_thread) {
+        if (streaming &&
+            per_thread.more_than_half_full(
+                per_thread.head.load(std::memory_order_relaxed))) {
+            wakeup.notify();
+        }
+    }
+
+    // maps a fresh segment file for the thread in place of its full one; the
+    // old mapping is dropped, its pages stay in the page cache
+    bool next_segment(PerThreadData &per_thread) {
+#if __unix__
+        size_t map_size = options.segment_size;
+        if (per_thread.segment) {
+            per_thread.segment_bytes +=
+                per_thread.head.load(std::memory_order_relaxed);
+            sys_munmap(per_thread.segment, map_size);
+            per_thread.segment = nullptr;
+            per_thread.segment_capacity = 0;
+        }
+        uint64_t sequence = per_thread.segment_sequence++;
+        uint32_t pid = (uint32_t)getpid();
+        std::string path = options.trace_dir + "/" + std::to_string(pid) +
+                           "-" + std::to_string(per_thread.index) + "-" +
+                           std::to_string(sequence) + ".seg";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+        if (fd == -1) {
+            return false;
+        }
+        // reserve the blocks up front, a store to a shared mapping beyond a
+        // full disk would raise SIGBUS
+        void *p = MAP_FAILED;
+        if (posix_fallocate(fd, 0, (off_t)map_size) == 0) {
+            p = sys_mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        auto segment = (TraceSegmentHeader *)p;
+        std::memcpy(segment->magic, kTraceSegmentMagic, 8);
+        segment->pid = pid;
+        segment->parent_pid = parent_pid;
+        segment->stream = per_thread.index;
+        segment->sequence = sequence;
+        segment->capacity = map_size - TraceSegmentHeader::kSize;
+        segment->clock = clock_so_far();
+        segment->committed.store(0, std::memory_order_release);
+        per_thread.segment = segment;
+        per_thread.segment_capacity = segment->capacity;
+        per_thread.ring = (unsigned char *)p + TraceSegmentHeader::kSize;
+        per_thread.head.store(0, std::memory_order_relaxed);
+        return true;
+#else
+        (void)per_thread;
+        return false;
+#endif
+    }
+
+    // moves as much of the ring into chunks as the memory limit allows,
+    // applying the overflow policy once it is reached; returns false if
+    // nothing could be moved. `force` ignores the limit, for the final drain
+    bool collect(PerThreadData &per_thread, bool force = false) {
+        std::lock_guard<std::mutex> guard(lock);
+        return collect_locked(per_thread, force);
+    }
+
+    // collect() for callers already holding `lock`
+    bool collect_locked(PerThreadData &per_thread, bool force) {
+        auto pending = per_thread.peek();
+        size_t size = pending.size[0] + pending.size[1];
+        size_t moved = append(per_thread.collected, pending.data[0],
+                              pending.size[0], force);
+        if (moved == pending.size[0]) {
+            moved += append(per_thread.collected, pending.data[1],
+                            pending.size[1], force);
+        }
+        per_thread.release(pending.head - size + moved);
+        return moved || !size;
+    }
+
+    size_t append(ChunkList &list, unsigned char const *data, size_t size,
+                  bool force) {
+        size_t done = 0;
+        while (done < size) {
+            Chunk *chunk = list.last;
+            if (!chunk || chunk->size == Chunk::kCapacity) {
+                chunk = allocate_chunk(force);
+                if (!chunk) {
+                    break;
+                }
+                list.push_back(chunk);
+            }
+            size_t n = std::min(size - done, Chunk::kCapacity - chunk->size);
+            std::memcpy(chunk->data + chunk->size, data + done, n);
+            chunk->size += n;
+            done += n;
+        }
+        return done;
+    }
+
+    Chunk *allocate_chunk(bool force) {
+        if (!free_chunks && max_chunks && mapped_chunks >= max_chunks &&
+            !force) {
+            overflow();
+        }
+        if (Chunk *chunk = free_chunks) {
+            free_chunks = chunk->next;
+            return chunk;
+        }
+        if (max_chunks && mapped_chunks >= max_chunks && !force) {
+            return nullptr;
+        }
+        auto chunk = (Chunk *)map_memory(sizeof(Chunk));
+        if (chunk) {
+            ++mapped_chunks;
+        }
+        return chunk;
+    }
+
+    // called under `lock`, as is everything touching free_chunks
+    void free_chunk_list(Chunk *chunk) {
+        if (chunk) {
+            chunks_recycled.fetch_add(1, std::memory_order_relaxed);
+        }
+        while (chunk) {
+            Chunk *next = chunk->next;
+            chunk->next = free_chunks;
+            free_chunks = chunk;
+            chunk = next;
+        }
+    }
+
+    // the memory limit is reached and no chunk is free, called under `lock`
+    void overflow() {
+        switch (options.overflow) {
+        case CaptureOptions::Overflow::Spill:
+            // while streaming, the exporter frees chunks by itself
+            if (!streaming && !spill_all()) {
+                options.overflow = CaptureOptions::Overflow::Drop;
+            }
+            break;
+        case CaptureOptions::Overflow::Drop: break;
+        case CaptureOptions::Overflow::Stop:
+            overflow_stopped.store(true);
+            tracing.store(false, std::memory_order_release);
+            break;
+        }
+    }
+
+    // writes the chunks of every thread to the spill file as trace frames,
+    // then recycles them
+    bool spill_all() {
+        if (!spill) {
+            spill_path = spill_file_path();
+            spill = std::make_unique<TraceOutput>(spill_path);
+            if (!spill->ok()) {
+                std::cerr << "Cannot open spill file " << spill_path
+                          << ", dropping events instead\n";
+                spill.reset();
+                return false;
+            }
+        }
+        std::vector<TraceFrameHeader> headers;
+        std::vector<TraceIoVec> iov;
+        headers.reserve(mapped_chunks);
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            for (Chunk *chunk = per_thread->collected.first; chunk;
+                 chunk = chunk->next) {
+                headers.push_back({per_thread->index, (uint32_t)chunk->size});
+                iov.push_back({&headers.back(), sizeof(TraceFrameHeader)});
+                iov.push_back({chunk->data, chunk->size});
+                spilled_bytes += chunk->size;
+            }
+        }
+        spill->write(iov.data(), iov.size());
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            free_chunk_list(per_thread->collected.release());
+        }
+        return true;
+    }
+
+    static std::string spill_file_path() {
+#if _WIN32
+        char const *dir = std::getenv("TEMP");
+        char const *fallback = ".";
+        unsigned long pid = GetCurrentProcessId();
+#else
+        char const *dir = std::getenv("TMPDIR");
+        char const *fallback = "/tmp";
+        unsigned long pid = (unsigned long)getpid();
+#endif
+        return std::string(dir && *dir ? dir : fallback) + "/mallocvis-" +
+               std::to_string(pid) + ".spill";
+    }
+
+    void write_process(TraceOutput &out) {
+        uint32_t pids[2] = {get_process_id(), parent_pid};
+        TraceFrameHeader header{kTraceProcessStream, sizeof(pids)};
+        TraceIoVec iov[2] = {{&header, sizeof(header)}, {pids, sizeof(pids)}};
+        out.write(iov, 2);
+    }
+
+    void write_clock(TraceOutput &out) {
+        write_clock(out, clock);
+    }
+
+    void write_clock(TraceOutput &out, TraceClockCalibration const &c) {
+        TraceFrameHeader header{kTraceClockStream, sizeof(c)};
+        TraceIoVec iov[2] = {{&header, sizeof(header)},
+                             {(void *)&c, sizeof(c)}};
+        out.write(iov, 2);
+    }
+
+    uint32_t intern_tag(char const *name, char const *&interned) {
+        std::lock_guard<std::mutex> guard(tag_lock);
+        auto [it, inserted] =
+            tag_ids.try_emplace(name, (uint32_t)tag_names.size() + 1);
+        if (inserted) {
+            tag_names.emplace_back(name);
+        }
+        interned = tag_names[it->second - 1].c_str();
+        return it->second;
+    }
+
+    std::vector<std::string> tag_table() {
+        std::lock_guard<std::mutex> guard(tag_lock);
+        std::vector<std::string> tags(1);
+        tags.insert(tags.end(), tag_names.begin(), tag_names.end());
+        return tags;
+    }
+
+    void write_tags(TraceOutput &out) {
+        std::vector<char> frame;
+        auto tags = tag_table();
+        for (uint32_t id = 1; id < tags.size(); ++id) {
+            uint32_t length = (uint32_t)tags[id].size();
+            frame.insert(frame.end(), (char const *)&id,
+                         (char const *)(&id + 1));
+            frame.insert(frame.end(), (char const *)&length,
+                         (char const *)(&length + 1));
+            frame.insert(frame.end(), tags[id].begin(), tags[id].end());
+        }
+        if (!frame.empty()) {
+            TraceFrameHeader header{kTraceTagStream, (uint32_t)frame.size()};
+            TraceIoVec iov[2] = {{&header, sizeof(header)},
+                                 {frame.data(), frame.size()}};
+            out.write(iov, 2);
+        }
+    }
+
+    void write_stacks(TraceOutput &out) {
+        std::vector<char> frame;
+        stacks.for_each([&](uint32_t id, void *const *frames, size_t depth) {
+            uint32_t depth32 = (uint32_t)depth;
+            frame.insert(frame.end(), (char const *)&id,
+                         (char const *)(&id + 1));
+            frame.insert(frame.end(), (char const *)&depth32,
+                         (char const *)(&depth32 + 1));
+            frame.insert(frame.end(), (char const *)frames,
+                         (char const *)(frames + depth));
+        });
+        if (!frame.empty()) {
+            TraceFrameHeader header{kTraceStackStream, (uint32_t)frame.size()};
+            TraceIoVec iov[2] = {{&header, sizeof(header)},
+                                 {frame.data(), frame.size()}};
+            out.write(iov, 2);
+        }
+    }
+
+#if HAS_THREADS
+    void export_thread_entry();
+    void sampler_thread_entry();
+    void export_batch(TraceOutput &out);
+#endif
+
+    ~GlobalData() {
+        {
+            std::lock_guard<std::mutex> guard(start_lock);
+            exiting.store(true, std::memory_order_release);
+        }
+        tracing.store(false, std::memory_order_release);
+        calibrate(1);
+#if HAS_THREADS
+        start_cv.notify_all();
+        if (start_thread.joinable()) {
+            start_thread.join();
+        }
+        if (sampler_thread.joinable()) {
+            sampler_thread.join();
+        }
+        if (export_thread.joinable()) {
+            wakeup.notify();
+            export_thread.join();
+        }
+#endif
+#if __unix__
+        uint32_t pid = (uint32_t)getpid();
+        if (segmented) {
+            TraceOutput meta(options.trace_dir + "/" + std::to_string(pid) +
+                             ".meta");
+            write_clock(meta);
+            write_stacks(meta);
+            write_tags(meta);
+            write_process(meta);
+        }
+#endif
+        // the report and the plot are mallocvis's own work too
+        InternalScope internal;
+        if (aggregating) {
+            write_report(output_path(options.report_path));
+        }
+        if (export_plot_on_exit) {
+            std::vector<AllocAction> actions;
+            auto on_action = [&](AllocAction action) {
+                trace_action_to_ns(action, clock);
+                actions.push_back(action);
+            };
+            std::unordered_map<uint32_t, AllocActionStreamDecoder> decoders;
+            size_t bytes = 0;
+            if (spill) {
+                spill.reset();
+                std::ifstream in(spill_path, std::ios::binary);
+                std::vector<unsigned char> buf;
+                TraceFrameHeader header;
+                while (in.read((char *)&header, sizeof(header))) {
+                    buf.resize(header.size);
+                    if (!in.read((char *)buf.data(), header.size)) {
+                        break;
+                    }
+                    decoders[header.stream].feed(buf.data(), buf.size(),
+                                                 on_action);
+                    bytes += buf.size();
+                }
+                in.close();
+                std::remove(spill_path.c_str());
+            }
+#if __unix__
+            if (segmented) {
+                read_trace_segments(options.trace_dir, on_action, nullptr,
+                                    pid);
+            }
+#endif
+            uint64_t dropped = 0;
+            for (auto per_thread = per_threads.load(std::memory_order_acquire);
+                 per_thread; per_thread = per_thread->next) {
+                if (segmented) {
+                    bytes += per_thread->segment_bytes +
+                             per_thread->head.load(std::memory_order_relaxed);
+                    dropped += per_thread->dropped;
+                    continue;
+                }
+                collect(*per_thread, true);
+                auto &decoder = decoders[per_thread->index];
+                for (Chunk *chunk = per_thread->collected.first; chunk;
+                     chunk = chunk->next) {
+                    decoder.feed(chunk->data, chunk->size, on_action);
+                    bytes += chunk->size;
+                }
+                dropped += per_thread->dropped;
+            }
+            // the plot needs the memory more than the chunks do; detached
+            // threads may still be in make_room, which only stops new events
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (auto per_thread =
+                         per_threads.load(std::memory_order_acquire);
+                     per_thread; per_thread = per_thread->next) {
+                    free_chunk_list(per_thread->collected.release());
+                }
+                while (Chunk *chunk = free_chunks) {
+                    free_chunks = chunk->next;
+                    unmap_memory(chunk, sizeof(Chunk));
+                }
+            }
+            std::cerr << "Decoded " << actions.size() << " actions from "
+                      << bytes << " bytes...\n";
+            if (spilled_bytes) {
+                std::cerr << "Spilled " << spilled_bytes
+                          << " bytes to disk after reaching memory_limit\n";
+            }
+            if (dropped) {
+                std::cerr << "Dropped " << dropped
+                          << " events after reaching memory_limit\n";
+            }
+            if (overflow_stopped.load(std::memory_order_acquire)) {
+                std::cerr << "Stopped tracing after reaching memory_limit\n";
+            }
+            mallocvis_plot_alloc_actions(std::move(actions), stack_frames(),
+                                         tag_table(), parent_pid != 0);
+        }
+    }
+};
+
+thread_local PerThreadData *this_thread = nullptr;
+
+// where the current thread came from, as seen by the pthread_create hook
+struct ThreadOrigin {
+    uint32_t creator = 0;
+    void *caller = nullptr;
+    uint32_t stack = 0;
+    int64_t start_time = 0;
+};
+
+thread_local ThreadOrigin thread_origin;
+
+// records the exit of the owning thread and hands its buffer back for reuse
+struct ThreadExitHook {
+    ~ThreadExitHook();
+};
+
+thread_local ThreadExitHook thread_exit_hook;
+
+#if __unix__
+// only the forking thread survives in the child: every other ring is handed
+// back for reuse and everything recorded before the fork is dropped, as it
+// belongs to the parent's trace; the child starts its own outputs and
+// mallocvis threads from there
+void GlobalData::reset_after_fork() {
+# if HAS_THREADS
+    // the handles are stale, the threads behind them do not exist here
+    new (&export_thread) std::thread();
+    new (&start_thread) std::thread();
+    new (&sampler_thread) std::thread();
+    exporter_ready.store(false, std::memory_order_relaxed);
+    flush_requested.store(0, std::memory_order_relaxed);
+    flush_done.store(0, std::memory_order_relaxed);
+# endif
+    // only the forking thread came along
+    internal_calls.store(internal_call ? 1 : 0, std::memory_order_relaxed);
+    for (auto per_thread = per_threads.load(std::memory_order_acquire);
+         per_thread; per_thread = per_thread->next) {
+        if (per_thread->segment) {
+            // the parent keeps appending to its own segment files
+            sys_munmap(per_thread->segment, options.segment_size);
+            per_thread->segment = nullptr;
+            per_thread->segment_capacity = 0;
+            per_thread->head.store(0, std::memory_order_relaxed);
+        }
+        per_thread->segment_sequence = 0;
+        per_thread->segment_bytes = 0;
+        size_t h = per_thread->head.load(std::memory_order_relaxed);
+        per_thread->tail.store(h, std::memory_order_relaxed);
+        per_thread->cached_tail = h;
+        free_chunk_list(per_thread->collected.release());
+        per_thread->dropped = 0;
+        per_thread->resync = true;
+        per_thread->dropping = false;
+        if (per_thread == this_thread) {
+            per_thread->tid = get_thread_id();
+        } else {
+            per_thread->owned.store(false, std::memory_order_release);
+        }
+    }
+    spill.reset();
+    spill_path.clear();
+    spilled_bytes = 0;
+# if HAS_THREADS
+    if (streaming) {
+        export_thread = std::thread([this] {
+            export_thread_entry();
+        });
+    }
+    if (options.counter_interval_ms > 0 && !aggregating) {
+        sampler_thread = std::thread([this] {
+            sampler_thread_entry();
+        });
+    }
+# endif
+}
+#endif
+
+// the calling thread's open mallocvis::Scope tags, innermost last; scopes
+// nested deeper than kMaxDepth are counted but keep the tag of the last one
+// that fit
+struct TagStack {
+    static constexpr size_t kMaxDepth = 64;
+    static constexpr size_t kCacheSize = 16;
+
+    uint32_t ids[kMaxDepth];
+    size_t depth = 0;
+    // names recently resolved by this thread, hit if both the address and
+    // the contents match, so that temporary strings are safe to pass
+    char const *cache_keys[kCacheSize] = {};
+    char const *cache_names[kCacheSize] = {};
+    uint32_t cache_ids[kCacheSize] = {};
+
+    uint32_t current() const {
+        return depth ? ids[std::min(depth, kMaxDepth) - 1] : 0;
+    }
+
+    void push(uint32_t id) {
+        if (depth < kMaxDepth) {
+            ids[depth] = id;
+        }
+        ++depth;
+    }
+
+    void pop() {
+        if (depth) {
+            --depth;
+        }
+    }
+
+    uint32_t resolve(char const *name) {
+        if (!name || !global) {
+            return 0;
+        }
+        size_t i = ((uintptr_t)name >> 3) % kCacheSize;
+        if (cache_keys[i] == name && !std::strcmp(cache_names[i], name)) {
+            return cache_ids[i];
+        }
+        bool was_in_hook = in_hook;
+        in_hook = true;
+        char const *interned;
+        uint32_t id = global->intern_tag(name, interned);
+        in_hook = was_in_hook;
+        cache_keys[i] = name;
+        cache_names[i] = interned;
+        cache_ids[i] = id;
+        return id;
+    }
+};
+
+thread_local TagStack tag_stack;
+
+#if HAS_THREADS
+// drains every ring into its `collected` chunks, which under `lock` is only
+// a copy, then writes the chunks with the lock released, so that a producer
+// making room never waits on the disk or pipe; chunks are recycled once
+// written
+void GlobalData::export_batch(TraceOutput &out) {
+    struct Batch {
+        uint32_t index;
+        Chunk *chunks;
+    };
+
+    static thread_local std::vector<Batch> batches;
+    static thread_local std::vector<TraceFrameHeader> headers;
+    static thread_local std::vector<TraceIoVec> iov;
+    batches.clear();
+    headers.clear();
+    iov.clear();
+
+    size_t frames = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto per_thread = per_threads.load(std::memory_order_acquire);
+             per_thread; per_thread = per_thread->next) {
+            collect_locked(*per_thread, true);
+            Batch batch{per_thread->index, per_thread->collected.release()};
+            for (Chunk *chunk = batch.chunks; chunk; chunk = chunk->next) {
+                ++frames;
+            }
+            if (batch.chunks) {
+                batches.push_back(batch);
+            }
+        }
+    }
+    if (batches.empty()) {
+        return;
+    }
+    headers.reserve(frames);
+    for (auto const &batch: batches) {
+        for (Chunk *chunk = batch.chunks; chunk; chunk = chunk->next) {
+            headers.push_back({batch.index, (uint32_t)chunk->size});
+            iov.push_back({&headers.back(), sizeof(TraceFrameHeader)});
+            iov.push_back({chunk->data, chunk->size});
+        }
+    }
+    out.write(iov.data(), iov.size());
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto const &batch: batches) {
+        free_chunk_list(batch.chunks);
+    }
+}
+
+void GlobalData::export_thread_entry() {
+    in_hook = true;
+    TraceOutput out(output_path(options.stream_path));
+    write_clock(out);
+    exporter_ready.store(true, std::memory_order_release);
+    while (!exiting.load(std::memory_order_acquire)) {
+        uint64_t request = flush_requested.load(std::memory_order_acquire);
+        if (clock.kind == TraceClockKind::Tsc) {
+            write_clock(out, clock_so_far());
+        }
+        export_batch(out);
+        flush_done.store(request, std::memory_order_release);
+        wakeup.wait(options.stream_latency_ms * 1000000);
+    }
+    exporter_ready.store(false, std::memory_order_release);
+    export_batch(out);
+    write_clock(out);
+    write_stacks(out);
+    write_tags(out);
+    write_process(out);
+}
+#endif
+
+struct EnableGuard {
+    PerThreadData *per_thread = nullptr;
+    // whether this guard set internal_call
+    bool internal = false;
+    // the rest is only set up by enter(), leaving the stopped path with
+    // the two stores above
+    // with latency:1, when the hook was entered, and a free to be recorded
+    // once the real allocator returns
+    int64_t start;
+    bool has_deferred;
+    AllocAction deferred;
+    // return address of the hook, blamed for program break moves
+    void *hook_caller;
+
+    // while stopped, this is all a hook adds to the real call: one relaxed
+    // load and a branch, with thread-locals only touched past it
+    EnableGuard() {
+        if (tracing.load(std::memory_order_relaxed)) {
+            enter();
+        }
+    }
+
+    MALLOCVIS_NOINLINE void enter() {
+        start = 0;
+        has_deferred = false;
+        hook_caller = nullptr;
+        if (!global) {
+            return;
+        }
+        if (in_hook) {
+            if (!internal_call) {
+                internal_call = internal = true;
+                internal_calls.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        per_thread = this_thread;
+        if (!per_thread) {
+            in_hook = true;
+            per_thread = this_thread = global->register_thread();
+            if (per_thread) {
+                (void)&thread_exit_hook;
+                thread_event(AllocOp::ThreadStart);
+            } else {
+                in_hook = false;
+            }
+        } else {
+            in_hook = true;
+        }
+        if (per_thread && global->options.latency) {
+            start = global->now();
+        }
+    }
+
+    explicit operator bool() const {
+        return per_thread != nullptr;
+    }
+
+    // seq is the sequence number sequence() reserved for this event, if any
+    void on(AllocOp op, void *ptr, size_t size, size_t align, void *caller,
+            uint64_t seq = 0) {
+        int64_t returned = start ? global->now() : 0;
+        hook_caller = caller;
+        if (ptr) {
+            bool is_allocation = kAllocOpIsAllocation[(size_t)op];
+            if (global->filtering &&
+                (!global->op_allowed[(size_t)op] ||
+                 (is_allocation && !global->passes_filters(size, caller)))) {
+                return;
+            }
+            if (global->aggregating) {
+                global->aggregate(*per_thread, op, ptr, size, caller);
+                return;
+            }
+            uint64_t weight = 0;
+            if (global->tracking) {
+                if (!is_allocation) {
+                    if (!global->recorded.erase(ptr)) {
+                        return;
+                    }
+                } else {
+                    if (global->options.sample_interval) {
+                        if ((per_thread->bytes_until_sample -= size) > 0) {
+                            return;
+                        }
+                        weight = global->take_sample(*per_thread, size);
+                    }
+                    if (!global->recorded.insert(ptr)) {
+                        return;
+                    }
+                }
+            }
+            uint32_t stack = 0;
+            if (global->options.stack_depth) {
+                stack = global->capture_stack_id(*per_thread, caller);
+            }
+            uint64_t slack =
+                is_allocation ? global->slack_of(op, ptr, size) : 0;
+            if (!seq) {
+                seq = sequence(ptr);
+            }
+            uint32_t cpu;
+            int64_t time = global->now(cpu);
+            AllocAction action{op,     per_thread->tid, ptr,
+                               size,   align,           caller,
+                               time,   weight,          stack,
+                               tag_stack.current(),     0,
+                               slack,  0,               seq,
+                               cpu};
+            commit(action, is_allocation, returned);
+        }
+    }
+
+    // records an address space change as is, region events are neither
+    // sampled nor filtered
+    void region(AllocOp op, void *ptr, size_t size, size_t extra,
+                void *caller) {
+        int64_t returned = start ? global->now() : 0;
+        hook_caller = caller;
+        if (!global->regions) {
+            return;
+        }
+        AllocAction action = region_action(op, ptr, size, extra, caller);
+        commit(action, kAllocOpIsAllocation[(size_t)op], returned);
+    }
+
+    // like region for a release, but taken before the real call, so that
+    // the range never seems reused before it was released, and only recorded
+    // once the call succeeded, see release_failed
+    void release(AllocOp op, void *ptr, size_t size, void *caller) {
+        hook_caller = caller;
+        if (!global->regions) {
+            return;
+        }
+        deferred = region_action(op, ptr, size, kNone, caller);
+        has_deferred = true;
+    }
+
+    void release_failed() {
+        has_deferred = false;
+    }
+
+    // records a block of a mallocvis::tracing_resource; these are neither
+    // sampled nor tracked, as they share addresses with the heap blocks
+    // their resource carved them from, and not timed, as the resource
+    // already returned
+    void resource(AllocOp op, uint32_t resource, void *ptr, size_t size,
+                  size_t align, void *caller) const {
+        if (!resource || !ptr || global->aggregating) {
+            return;
+        }
+        if (global->filtering &&
+            (!global->op_allowed[(size_t)op] ||
+             (kAllocOpIsAllocation[(size_t)op] &&
+              !global->passes_filters(size, caller)))) {
+            return;
+        }
+        uint32_t stack = 0;
+        if (global->options.stack_depth) {
+            stack = global->capture_stack_id(*per_thread, caller);
+        }
+        uint32_t cpu;
+        int64_t time = global->now(cpu);
+        AllocAction action{op,    per_thread->tid, ptr,
+                           size,  align,           caller,
+                           time,  0,               stack,
+                           tag_stack.current(),    0,
+                           0,     resource,        sequence(ptr),
+                           cpu};
+        record(action);
+    }
+
+    // takes the next sequence number of ptr; hooks that free a block after
+    // their real call reserve its number beforehand, so that it stays below
+    // that of whoever gets the block next
+    uint64_t sequence(void *ptr) const {
+        if (!ptr || !global->sequences.stripes) {
+            return 0;
+        }
+        return global->sequences.next(per_thread->seq_clock, ptr);
+    }
+
+    // records the program break moving from old_brk to new_brk
+    void program_break(uintptr_t old_brk, uintptr_t new_brk) const {
+        global->last_brk.store(new_brk, std::memory_order_relaxed);
+        if (!global->regions) {
+            return;
+        }
+        if (new_brk > old_brk) {
+            record(region_action(AllocOp::Brk, (void *)old_brk,
+                                 new_brk - old_brk, kNone, hook_caller));
+        } else if (new_brk < old_brk) {
+            record(region_action(AllocOp::Munmap, (void *)new_brk,
+                                 old_brk - new_brk, kNone, hook_caller));
+        }
+    }
+
+    AllocAction region_action(AllocOp op, void *ptr, size_t size,
+                              size_t extra, void *caller) const {
+        uint32_t stack = 0;
+        if (global->options.stack_depth) {
+            stack = global->capture_stack_id(*per_thread, caller);
+        }
+        uint32_t cpu;
+        int64_t time = global->now(cpu);
+        return AllocAction{op,    per_thread->tid, ptr,
+                           size,  extra,           caller,
+                           time,  0,               stack,
+                           tag_stack.current(),    0,
+                           0,     0,               0,
+                           cpu};
+    }
+
+    void commit(AllocAction &action, bool is_allocation, int64_t returned) {
+        if (global->options.latency) {
+            // frees keep the time they were entered, so that a block never
+            // seems reused before it was freed
+            if (!is_allocation) {
+                deferred = action;
+                has_deferred = true;
+                return;
+            }
+            action.latency = returned - start;
+        }
+        record(action);
+    }
+
+    uint32_t stack_of(void *caller) const {
+        if (!global->options.stack_depth) {
+            return 0;
+        }
+        return global->capture_stack_id(*per_thread, caller);
+    }
+
+    void counter(CounterKind kind, uint64_t value) const {
+        AllocAction action{AllocOp::Counter, per_thread->tid, nullptr,
+                           value,            (size_t)kind,    nullptr,
+                           global->now(),    0,               0,
+                           0,                0,               0,
+                           0,                0,               0};
+        record(action);
+    }
+
+    // records the start or exit of this thread under its current name; the
+    // start keeps the time and place the pthread_create hook saw it created
+    void thread_event(AllocOp op) const {
+        if (!global->thread_events) {
+            return;
+        }
+        uint32_t name = 0;
+        char buf[64];
+        if (get_thread_name(buf, sizeof(buf))) {
+            char const *interned;
+            name = global->intern_tag(buf, interned);
+        }
+        bool start = op == AllocOp::ThreadStart;
+        ThreadOrigin origin = start ? thread_origin : ThreadOrigin();
+        AllocAction action{op,    per_thread->tid, nullptr,
+                           origin.creator ? origin.creator : kNone,
+                           kNone, origin.caller,
+                           origin.start_time ? origin.start_time
+                                             : global->now(),
+                           0,     origin.stack,    name,
+                           0,     0,               0,
+                           0,     0};
+        record(action);
+    }
+
+    void mark(uint32_t tag, void *caller) const {
+        AllocAction action{AllocOp::Marker, per_thread->tid, nullptr,
+                           kNone,           kNone,           caller,
+                           global->now(),   0,               0,
+                           tag,             0,               0,
+                           0,               0,               0};
+        record(action);
+    }
+
+    void record(AllocAction const &action) const {
+        if (per_thread->dropping) {
+            if (!global->may_have_room(*per_thread)) {
+                ++per_thread->dropped;
+                return;
+            }
+            per_thread->dropping = false;
+        }
+        unsigned char buf[kCodecMaxRecordSize + 16];
+        size_t n = 0;
+        if (per_thread->resync) {
+            n = per_thread->encoder.begin(buf, per_thread->tid);
+        }
+        n += per_thread->encoder.encode(buf + n, action);
+        while (!per_thread->push(buf, n)) {
+            if (!global->make_room(*per_thread)) {
+                ++per_thread->dropped;
+                per_thread->resync = true;
+                global->start_dropping(*per_thread);
+                return;
+            }
+        }
+        per_thread->resync = false;
+        global->after_push(*per_thread);
+    }
+
+    ~EnableGuard() {
+        if (per_thread || internal) {
+            leave();
+        }
+    }
+
+    MALLOCVIS_NOINLINE void leave() {
+        if (has_deferred) {
+            if (start) {
+                deferred.latency = global->now() - deferred.time;
+            }
+            record(deferred);
+        }
+#if __linux__ && __GLIBC__
+        // glibc's malloc moves the break through its internal __sbrk, which
+        // no hook sees
+        if (per_thread && global->watch_brk) {
+            uintptr_t old_brk =
+                global->last_brk.load(std::memory_order_relaxed);
+            uintptr_t new_brk = (uintptr_t)__curbrk;
+            if (new_brk != old_brk && old_brk &&
+                global->last_brk.compare_exchange_strong(
+                    old_brk, new_brk, std::memory_order_relaxed)) {
+                program_break(old_brk, new_brk);
+            }
+        }
+#endif
+        if (per_thread) {
+            in_hook = false;
+        }
+        if (internal) {
+            internal_call = false;
+            internal_calls.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+ThreadExitHook::~ThreadExitHook() {
+    if (this_thread && global &&
+        !global->exiting.load(std::memory_order_acquire)) {
+        {
+            EnableGuard ena;
+            if (ena) {
+                ena.thread_event(AllocOp::ThreadExit);
+            }
+        }
+        in_hook = true;
+        global->release_thread(this_thread);
+        this_thread = nullptr;
+    }
+}
+
+#if HAS_THREADS
+// samples the counters explaining RSS beyond live bytes; runs on its own
+// thread, as reading them takes the kernel's and glibc's locks
+void GlobalData::sampler_thread_entry() {
+    in_hook = true;
+    // registered up front, so that the guard below takes this thread's
+    // buffer as is instead of reporting it as a program thread with a
+    // ThreadStart and, since it is joined after tracing stopped, no exit
+    this_thread = register_thread();
+# if __unix__
+    int statm = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+#  if __GLIBC__
+    // mallinfo2 describes glibc's heap only, which is empty when another
+    // allocator was preloaded
+    bool glibc_heap =
+        dlsym(RTLD_NEXT, "malloc") == dlsym(RTLD_NEXT, "__libc_malloc");
+#  endif
+    auto interval = std::chrono::duration<double, std::milli>(
+        options.counter_interval_ms);
+    std::unique_lock<std::mutex> guard(start_lock);
+    while (!start_cv.wait_for(guard, interval, [this] {
+        return exiting.load(std::memory_order_relaxed);
+    })) {
+        guard.unlock();
+        // the guard takes over in_hook while it samples, so that the
+        // sample lands in this thread's buffer
+        in_hook = false;
+        {
+            EnableGuard ena;
+            if (ena) {
+                char buf[128];
+                ssize_t n =
+                    statm == -1 ? -1 : pread(statm, buf, sizeof(buf) - 1, 0);
+                if (n > 0) {
+                    buf[n] = 0;
+                    char *end;
+                    std::strtoull(buf, &end, 10);
+                    uint64_t resident = std::strtoull(end, nullptr, 10);
+                    ena.counter(CounterKind::Rss, resident * page_size);
+                }
+                rusage usage;
+                if (getrusage(RUSAGE_SELF, &usage) == 0) {
+                    ena.counter(CounterKind::MinorFaults,
+                                (uint64_t)usage.ru_minflt);
+                    ena.counter(CounterKind::MajorFaults,
+                                (uint64_t)usage.ru_majflt);
+                }
+#  if __GLIBC__
+#   if __GLIBC_PREREQ(2, 33)
+                if (glibc_heap) {
+                    struct mallinfo2 info = mallinfo2();
+                    ena.counter(CounterKind::HeapMapped,
+                                info.arena + info.hblkhd);
+                    ena.counter(CounterKind::HeapInUse,
+                                info.uordblks + info.hblkhd);
+                    ena.counter(CounterKind::HeapFree, info.fordblks);
+                    ena.counter(CounterKind::HeapTopPad, info.keepcost);
+                }
+#   endif
+#  endif
+            }
+        }
+        in_hook = true;
+        guard.lock();
+    }
+    if (statm != -1) {
+        close(statm);
+    }
+# endif
+}
+#endif
+
+} // namespace
+
+#if __GNUC__ && !_WIN32
+#if defined(__FreeBSD__)
+extern "C" void* malloc(size_t size);
+extern "C" void free(void* ptr);
+extern "C" void* calloc(size_t nmemb, size_t size);
+extern "C" void* realloc(void *ptr, size_t size);
+extern "C" void * reallocarray(void *ptr, size_t nmemb,
+                                     size_t size);
+extern "C" void * valloc(size_t size);
+extern "C" void* memalign(size_t alignment, size_t size);
+
+namespace {
+size_t real_usable_size(void *ptr) noexcept {
+    return malloc_usable_size(ptr);
+}
+} // namespace
+#else
+extern "C" void *__libc_malloc(size_t size) noexcept;
+extern "C" void __libc_free(void *ptr) noexcept;
+extern "C" void *__libc_calloc(size_t nmemb, size_t size) noexcept;
+extern "C" void *__libc_realloc(void *ptr, size_t size) noexcept;
+extern "C" void *__libc_reallocarray(void *ptr, size_t nmemb,
+                                     size_t size) noexcept;
+extern "C" void *__libc_valloc(size_t size) noexcept;
+extern "C" void *__libc_memalign(size_t align, size_t size) noexcept;
+# if __linux__
+extern "C" void *__sbrk(intptr_t increment) noexcept;
+# endif
+
+namespace {
+
+# if __linux__
+// used for the address space calls that dlsym cannot resolve yet
+void *fallback_mmap(void *addr, size_t size, int prot, int flags, int fd,
+                    off_t offset) noexcept {
+    return sys_mmap(addr, size, prot, flags, fd, offset);
+}
 
-namespace {
+int fallback_munmap(void *addr, size_t size) noexcept {
+    return sys_munmap(addr, size);
+}
 
-uint32_t get_thread_id() {
-#if defined(__FreeBSD__)
-    return pthread_getthreadid_np();
-#elif __unix__
-    return gettid();
-#elif _WIN32
-    return GetCurrentThreadId();
-#else
-    return 0;
-#endif
+void *fallback_mremap(void *old_addr, size_t old_size, size_t new_size,
+                      int flags, ...) noexcept {
+    va_list args;
+    va_start(args, flags);
+    void *new_addr = va_arg(args, void *);
+    va_end(args);
+    long ret = syscall(SYS_mremap, old_addr, old_size, new_size, flags,
+                       new_addr);
+    return (void *)ret;
 }
 
-struct alignas(64) PerThreadData {
-#if HAS_PMR
-    size_t const bufsz = 64 * 1024 * 1024;
-# if __unix__
-    void *buf = mmap(nullptr, bufsz, PROT_READ | PROT_WRITE,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-# elif _WIN32
-    void *buf =
-        VirtualAlloc(nullptr, bufsz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-# else
-    static char buf[bufsz];
+int fallback_madvise(void *addr, size_t size, int advice) noexcept {
+    return (int)syscall(SYS_madvise, addr, size, advice);
+}
+
+int fallback_brk(void *addr) noexcept {
+    void *old_brk = __sbrk(0);
+    return __sbrk((char *)addr - (char *)old_brk) == (void *)-1 ? -1 : 0;
+}
 # endif
-    std::pmr::monotonic_buffer_resource mono{buf, bufsz};
-    std::pmr::unsynchronized_pool_resource pool{&mono};
-#endif
 
-    std::recursive_mutex lock;
-    PMR::deque<AllocAction> actions PMR_RES(&pool);
-    bool enable = false;
+// the allocator we interpose, i.e. whatever defines malloc after us in the
+// lookup order (jemalloc, tcmalloc, mimalloc or glibc), found with
+// dlsym(RTLD_NEXT); glibc's own entry points are the fallback for anything
+// it does not export
+struct RealAllocator {
+    void *(*malloc)(size_t) noexcept = nullptr;
+    void (*free)(void *) noexcept = nullptr;
+    void *(*calloc)(size_t, size_t) noexcept = nullptr;
+    void *(*realloc)(void *, size_t) noexcept = nullptr;
+    void *(*reallocarray)(void *, size_t, size_t) noexcept = nullptr;
+    void *(*valloc)(size_t) noexcept = nullptr;
+    void *(*memalign)(size_t, size_t) noexcept = nullptr;
+    size_t (*usable_size)(void *) noexcept = nullptr;
+# if __linux__
+    void *(*mmap)(void *, size_t, int, int, int, off_t) noexcept = nullptr;
+    int (*munmap)(void *, size_t) noexcept = nullptr;
+    void *(*mremap)(void *, size_t, size_t, int, ...) noexcept = nullptr;
+    int (*madvise)(void *, size_t, int) noexcept = nullptr;
+    void *(*sbrk)(intptr_t) noexcept = nullptr;
+    int (*brk)(void *) noexcept = nullptr;
+# endif
 };
 
-struct GlobalData {
-    std::mutex lock;
+RealAllocator real_allocator;
 
-    static inline size_t const kPerThreadsCount = 8;
-    PerThreadData per_threads[kPerThreadsCount];
-    bool export_plot_on_exit = true;
-#if HAS_THREADS
-    std::thread export_thread;
-#endif
-    std::atomic<bool> stopped{false};
+enum RealState {
+    kUnresolved,
+    kResolving,
+    kResolved,
+};
 
-    GlobalData() {
-#if HAS_THREADS
-        if (0) {
-            std::string path = "malloc.fifo";
-            export_thread = std::thread([this, path] {
-                get_per_thread(get_thread_id())->enable = false;
-                export_thread_entry(path);
-            });
-            export_plot_on_exit = false;
-        }
-#endif
-        for (size_t i = 0; i < kPerThreadsCount; ++i) {
-            per_threads[i].enable = true;
+std::atomic<int> real_state{kUnresolved};
+
+// serves allocations made while dlsym itself runs (it may calloc an error
+// buffer); blocks here are never freed, and keep their size just before
+// them so that realloc can move them out
+struct BootstrapArena {
+    static inline size_t const kSize = 64 * 1024;
+    static inline size_t const kHeader = 16;
+
+    alignas(64) char buf[kSize];
+    std::atomic<size_t> used{0};
+
+    bool owns(void *ptr) const {
+        return (char *)ptr >= buf && (char *)ptr < buf + kSize;
+    }
+
+    void *allocate(size_t size, size_t align = kHeader) {
+        if (align < kHeader) {
+            align = kHeader;
         }
+        size_t old = used.load(std::memory_order_relaxed);
+        size_t start;
+        do {
+            start = (old + kHeader + align - 1) & ~(align - 1);
+            if (start + size > kSize || start + size < start) {
+                return nullptr;
+            }
+        } while (!used.compare_exchange_weak(old, start + size,
+                                             std::memory_order_relaxed));
+        std::memcpy(buf + start - sizeof(size_t), &size, sizeof(size_t));
+        return buf + start;
     }
 
-    PerThreadData *get_per_thread(uint32_t tid) {
-        return per_threads + ((size_t)tid * 17) % kPerThreadsCount;
+    size_t size_of(void *ptr) const {
+        size_t size;
+        std::memcpy(&size, (char *)ptr - sizeof(size_t), sizeof(size_t));
+        return size;
     }
+};
 
-#if HAS_THREADS
-    void export_thread_entry(std::string const &path) {
-# if HAS_PMR
-        size_t const bufsz = 64 * 1024 * 1024;
-#  if __unix__
-        void *buf = mmap(nullptr, bufsz, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-#  elif _WIN32
-        void *buf = VirtualAlloc(nullptr, bufsz, MEM_RESERVE | MEM_COMMIT,
-                                 PAGE_READWRITE);
-#  else
-        static char buf[bufsz];
-#  endif
-        std::pmr::monotonic_buffer_resource mono{buf, bufsz};
-        std::pmr::unsynchronized_pool_resource pool{&mono};
-# endif
-
-        std::ofstream out(path, std::ios::binary);
-        PMR::deque<AllocAction> actions PMR_RES(&pool);
-        while (!stopped.load(std::memory_order_acquire)) {
-            for (auto &per_thread: per_threads) {
-                std::unique_lock<std::recursive_mutex> guard(per_thread.lock);
-                auto thread_actions = std::move(per_thread.actions);
-                guard.unlock();
-                actions.insert(actions.end(), thread_actions.begin(),
-                               thread_actions.end());
-            }
-            if (!actions.empty()) {
-                for (auto &action: actions) {
-                    out.write((char const *)&action, sizeof(AllocAction));
-                }
-                actions.clear();
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+BootstrapArena bootstrap_arena;
+
+// allocators without malloc_usable_size report no slack
+size_t fallback_usable_size(void *) noexcept {
+    return 0;
+}
+
+template <class Fn>
+void resolve_symbol(Fn &fn, char const *name, Fn fallback) {
+    fn = (Fn)dlsym(RTLD_NEXT, name);
+    if (!fn) {
+        fn = fallback;
+    }
+}
+
+MALLOCVIS_NOINLINE bool resolve_real_allocator_slow() {
+    int state = real_state.load(std::memory_order_acquire);
+    if (state == kResolved) {
+        return true;
+    }
+    if (state == kResolving ||
+        !real_state.compare_exchange_strong(state, kResolving,
+                                            std::memory_order_acquire)) {
+        return real_state.load(std::memory_order_acquire) == kResolved;
+    }
+    auto &r = real_allocator;
+    resolve_symbol(r.malloc, "malloc", __libc_malloc);
+    resolve_symbol(r.free, "free", __libc_free);
+    resolve_symbol(r.calloc, "calloc", __libc_calloc);
+    resolve_symbol(r.realloc, "realloc", __libc_realloc);
+    resolve_symbol(r.valloc, "valloc", __libc_valloc);
+    resolve_symbol(r.memalign, "memalign", __libc_memalign);
+    resolve_symbol(r.usable_size, "malloc_usable_size", fallback_usable_size);
+# if __linux__
+    resolve_symbol(r.mmap, "mmap", fallback_mmap);
+    resolve_symbol(r.munmap, "munmap", fallback_munmap);
+    resolve_symbol(r.mremap, "mremap", fallback_mremap);
+    resolve_symbol(r.madvise, "madvise", fallback_madvise);
+    resolve_symbol(r.sbrk, "sbrk", __sbrk);
+    resolve_symbol(r.brk, "brk", fallback_brk);
+# endif
+    // mixing heaps is worse than a missing overflow check, so only use
+    // glibc's reallocarray when glibc is the allocator
+    r.reallocarray =
+        (decltype(r.reallocarray))dlsym(RTLD_NEXT, "reallocarray");
+    if (!r.reallocarray && r.realloc == __libc_realloc) {
+        r.reallocarray = __libc_reallocarray;
+    }
+    real_state.store(kResolved, std::memory_order_release);
+    return true;
+}
+
+// false while the symbols are being looked up, callers then fall back to
+// the bootstrap arena
+inline bool resolve_real_allocator() {
+    return real_state.load(std::memory_order_acquire) == kResolved ||
+           resolve_real_allocator_slow();
+}
+
+void *real_malloc(size_t size) noexcept {
+    if (!resolve_real_allocator()) {
+        return bootstrap_arena.allocate(size);
+    }
+    if (in_internal_call()) {
+        if (void *p = internal_heap.allocate(size)) {
+            return p;
         }
-        for (auto &per_thread: per_threads) {
-            std::unique_lock<std::recursive_mutex> guard(per_thread.lock);
-            auto thread_actions = std::move(per_thread.actions);
-            guard.unlock();
-            actions.insert(actions.end(), thread_actions.begin(),
-                           thread_actions.end());
+    }
+    return real_allocator.malloc(size);
+}
+
+void real_free(void *ptr) noexcept {
+    if (internal_heap.owns(ptr)) {
+        internal_heap.deallocate(ptr);
+        return;
+    }
+    if (bootstrap_arena.owns(ptr)) {
+        return;
+    }
+    if (resolve_real_allocator()) {
+        real_allocator.free(ptr);
+    }
+}
+
+void *real_calloc(size_t nmemb, size_t size) noexcept {
+    if (!resolve_real_allocator()) {
+        if (size && nmemb > (size_t)-1 / size) {
+            return nullptr;
         }
-        if (!actions.empty()) {
-            for (auto &action: actions) {
-                out.write((char const *)&action, sizeof(AllocAction));
-            }
-            actions.clear();
+        // the arena is static storage and never reused, hence zeroed
+        return bootstrap_arena.allocate(nmemb * size);
+    }
+    if (in_internal_call() && !(size && nmemb > (size_t)-1 / size)) {
+        // freed blocks are reused, so unlike the bootstrap arena not zeroed
+        if (void *p = internal_heap.allocate(nmemb * size)) {
+            return std::memset(p, 0, nmemb * size);
         }
     }
-#endif
+    return real_allocator.calloc(nmemb, size);
+}
 
-    ~GlobalData() {
-        for (size_t i = 0; i < kPerThreadsCount; ++i) {
-            per_threads[i].enable = false;
+void *real_realloc(void *ptr, size_t size) noexcept {
+    if (internal_heap.owns(ptr)) {
+        if (size && size <= internal_heap.size_of(ptr)) {
+            return ptr;
         }
-        if (export_thread.joinable()) {
-            stopped.store(true, std::memory_order_release);
-            export_thread.join();
+        void *new_ptr = size ? real_malloc(size) : nullptr;
+        if (new_ptr) {
+            std::memcpy(new_ptr, ptr,
+                        std::min(size, internal_heap.size_of(ptr)));
         }
-        if (export_plot_on_exit) {
-            std::vector<AllocAction> actions;
-            for (size_t i = 0; i < kPerThreadsCount; ++i) {
-                auto &their_actions = per_threads[i].actions;
-                actions.insert(actions.end(), their_actions.begin(),
-                               their_actions.end());
-            }
-            mallocvis_plot_alloc_actions(std::move(actions));
+        if (new_ptr || !size) {
+            internal_heap.deallocate(ptr);
         }
+        return new_ptr;
     }
-};
+    if (!ptr && in_internal_call()) {
+        return real_malloc(size);
+    }
+    if (bootstrap_arena.owns(ptr)) {
+        void *new_ptr = real_malloc(size);
+        if (new_ptr) {
+            std::memcpy(new_ptr, ptr,
+                        std::min(size, bootstrap_arena.size_of(ptr)));
+        }
+        return new_ptr;
+    }
+    if (!resolve_real_allocator()) {
+        return bootstrap_arena.allocate(size);
+    }
+    return real_allocator.realloc(ptr, size);
+}
 
-GlobalData *global = nullptr;
+void *real_reallocarray(void *ptr, size_t nmemb, size_t size) noexcept {
+    if (resolve_real_allocator() && real_allocator.reallocarray &&
+        !bootstrap_arena.owns(ptr) && !internal_heap.owns(ptr) &&
+        (ptr || !in_internal_call())) {
+        return real_allocator.reallocarray(ptr, nmemb, size);
+    }
+    if (size && nmemb > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return real_realloc(ptr, nmemb * size);
+}
 
-struct EnableGuard {
-    uint32_t tid;
-    bool was_enable;
-    PerThreadData *per_thread;
+void *real_valloc(size_t size) noexcept {
+    if (!resolve_real_allocator()) {
+        return bootstrap_arena.allocate(size, 4096);
+    }
+    if (in_internal_call()) {
+        if (void *p = internal_heap.allocate(size, 4096)) {
+            return p;
+        }
+    }
+    return real_allocator.valloc(size);
+}
 
-    EnableGuard()
-        : tid(get_thread_id()),
-          per_thread(global ? global->get_per_thread(tid) : nullptr) {
-        if (!per_thread) {
-            was_enable = false;
-        } else {
-            per_thread->lock.lock();
-            was_enable = per_thread->enable;
-            per_thread->enable = false;
+void *real_memalign(size_t align, size_t size) noexcept {
+    if (!resolve_real_allocator()) {
+        return bootstrap_arena.allocate(size, align);
+    }
+    if (in_internal_call()) {
+        if (void *p = internal_heap.allocate(size, align)) {
+            return p;
         }
     }
+    return real_allocator.memalign(align, size);
+}
 
-    explicit operator bool() const {
-        return was_enable;
+size_t real_usable_size(void *ptr) noexcept {
+    if (internal_heap.owns(ptr)) {
+        return internal_heap.size_of(ptr);
+    }
+    if (bootstrap_arena.owns(ptr)) {
+        return bootstrap_arena.size_of(ptr);
     }
+    if (!resolve_real_allocator()) {
+        return 0;
+    }
+    return real_allocator.usable_size(ptr);
+}
 
-    void on(AllocOp op, void *ptr, size_t size, size_t align,
-            void *caller) const {
-        if (ptr) {
-            auto now = std::chrono::high_resolution_clock::now();
-            int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                               now.time_since_epoch())
-                               .count();
-            per_thread->actions.push_back(
-                AllocAction{op, tid, ptr, size, align, caller, time});
-        }
+# if __linux__
+void *real_mmap(void *addr, size_t size, int prot, int flags, int fd,
+                off_t offset) noexcept {
+    if (!resolve_real_allocator()) {
+        return fallback_mmap(addr, size, prot, flags, fd, offset);
     }
+    return real_allocator.mmap(addr, size, prot, flags, fd, offset);
+}
 
-    ~EnableGuard() {
-        if (per_thread) {
-            per_thread->enable = was_enable;
-            per_thread->lock.unlock();
-        }
+int real_munmap(void *addr, size_t size) noexcept {
+    if (!resolve_real_allocator()) {
+        return fallback_munmap(addr, size);
     }
-};
+    return real_allocator.munmap(addr, size);
+}
 
-} // namespace
+void *real_mremap(void *old_addr, size_t old_size, size_t new_size,
+                  int flags, void *new_addr) noexcept {
+    if (!resolve_real_allocator()) {
+        return fallback_mremap(old_addr, old_size, new_size, flags, new_addr);
+    }
+    return real_allocator.mremap(old_addr, old_size, new_size, flags,
+                                 new_addr);
+}
 
-#if __GNUC__ && !_WIN32
-#if defined(__FreeBSD__)
-extern "C" void* malloc(size_t size);
-extern "C" void free(void* ptr);
-extern "C" void* calloc(size_t nmemb, size_t size);
-extern "C" void* realloc(void *ptr, size_t size);
-extern "C" void * reallocarray(void *ptr, size_t nmemb,
-                                     size_t size);
-extern "C" void * valloc(size_t size);
-extern "C" void* memalign(size_t alignment, size_t size);
-#else
-extern "C" void *__libc_malloc(size_t size) noexcept;
-extern "C" void __libc_free(void *ptr) noexcept;
-extern "C" void *__libc_calloc(size_t nmemb, size_t size) noexcept;
-extern "C" void *__libc_realloc(void *ptr, size_t size) noexcept;
-extern "C" void *__libc_reallocarray(void *ptr, size_t nmemb,
-                                     size_t size) noexcept;
-extern "C" void *__libc_valloc(size_t size) noexcept;
-extern "C" void *__libc_memalign(size_t align, size_t size) noexcept;
+int real_madvise(void *addr, size_t size, int advice) noexcept {
+    if (!resolve_real_allocator()) {
+        return fallback_madvise(addr, size, advice);
+    }
+    return real_allocator.madvise(addr, size, advice);
+}
+
+void *real_sbrk(intptr_t increment) noexcept {
+    if (!resolve_real_allocator()) {
+        return __sbrk(increment);
+    }
+    return real_allocator.sbrk(increment);
+}
+
+int real_brk(void *addr) noexcept {
+    if (!resolve_real_allocator()) {
+        return fallback_brk(addr);
+    }
+    return real_allocator.brk(addr);
+}
+# endif
+
+} // namespace
 #endif
 #if defined(__FreeBSD__)
 # define REAL_LIBC(name) name
 #else
-# define REAL_LIBC(name) __libc_##name
+# define REAL_LIBC(name) real_##name
 #endif
 # ifndef MAY_OVERRIDE_MALLOC
 #  define MAY_OVERRIDE_MALLOC 1
@@ -293,6 +3465,13 @@ static void *msvc_reallocarray(void *ptr, size_t nmemb, size_t size) noexcept {
     return msvc_realloc(ptr, nmemb * size);
 }
 
+namespace {
+size_t real_usable_size(void *ptr) noexcept {
+    SIZE_T size = HeapSize(GetProcessHeap(), 0, ptr);
+    return size == (SIZE_T)-1 ? 0 : size;
+}
+} // namespace
+
 # define REAL_LIBC(name) msvc_##name
 # ifndef MAY_OVERRIDE_MALLOC
 #  define MAY_OVERRIDE_MALLOC 0
@@ -308,6 +3487,12 @@ static void *msvc_reallocarray(void *ptr, size_t nmemb, size_t size) noexcept {
 # define CSTDLIB_NOEXCEPT
 
 #else
+namespace {
+size_t real_usable_size(void *) noexcept {
+    return 0;
+}
+} // namespace
+
 # define REAL_LIBC(name) name
 # ifndef MAY_OVERRIDE_MALLOC
 #  define MAY_OVERRIDE_MALLOC 0
@@ -350,12 +3535,13 @@ MALLOCVIS_EXPORT extern "C" void *calloc(size_t nmemb,
 MALLOCVIS_EXPORT extern "C" void *realloc(void *ptr,
                                           size_t size) CSTDLIB_NOEXCEPT {
     EnableGuard ena;
+    uint64_t seq = ena ? ena.sequence(ptr) : 0;
     void *new_ptr = REAL_LIBC(realloc)(ptr, size);
     if (ena) {
-        ena.on(AllocOp::Malloc, new_ptr, size, kNone, RETURN_ADDRESS);
         if (new_ptr) {
-            ena.on(AllocOp::Free, ptr, kNone, kNone, RETURN_ADDRESS);
+            ena.on(AllocOp::Free, ptr, kNone, kNone, RETURN_ADDRESS, seq);
         }
+        ena.on(AllocOp::Malloc, new_ptr, size, kNone, RETURN_ADDRESS);
     }
     return new_ptr;
 }
@@ -363,12 +3549,13 @@ MALLOCVIS_EXPORT extern "C" void *realloc(void *ptr,
 MALLOCVIS_EXPORT extern "C" void *reallocarray(void *ptr, size_t nmemb,
                                                size_t size) CSTDLIB_NOEXCEPT {
     EnableGuard ena;
+    uint64_t seq = ena ? ena.sequence(ptr) : 0;
     void *new_ptr = REAL_LIBC(reallocarray)(ptr, nmemb, size);
     if (ena) {
-        ena.on(AllocOp::Malloc, new_ptr, nmemb * size, kNone, RETURN_ADDRESS);
         if (new_ptr) {
-            ena.on(AllocOp::Free, ptr, kNone, kNone, RETURN_ADDRESS);
+            ena.on(AllocOp::Free, ptr, kNone, kNone, RETURN_ADDRESS, seq);
         }
+        ena.on(AllocOp::Malloc, new_ptr, nmemb * size, kNone, RETURN_ADDRESS);
     }
     return new_ptr;
 }
@@ -429,6 +3616,160 @@ MALLOCVIS_EXPORT extern "C" int posix_memalign(void **memptr, size_t align,
     return ret;
 }
 # endif
+
+# if __linux__ && !defined(__FreeBSD__)
+// address space hooks, recorded with mmap:1; unmapping is recorded before
+// the call like free, so another thread cannot map the range first
+MALLOCVIS_EXPORT extern "C" void *mmap(void *addr, size_t size, int prot,
+                                       int flags, int fd,
+                                       off_t offset) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    void *ptr = real_mmap(addr, size, prot, flags, fd, offset);
+    if (ena && ptr != MAP_FAILED) {
+        ena.region(AllocOp::Mmap, ptr, size, kNone, RETURN_ADDRESS);
+    }
+    return ptr;
+}
+
+#  if __LP64__ && defined(__USE_LARGEFILE64)
+MALLOCVIS_EXPORT extern "C" void *mmap64(void *addr, size_t size, int prot,
+                                         int flags, int fd,
+                                         off64_t offset) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    void *ptr = real_mmap(addr, size, prot, flags, fd, offset);
+    if (ena && ptr != MAP_FAILED) {
+        ena.region(AllocOp::Mmap, ptr, size, kNone, RETURN_ADDRESS);
+    }
+    return ptr;
+}
+#  endif
+
+MALLOCVIS_EXPORT extern "C" int munmap(void *addr,
+                                       size_t size) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    if (ena) {
+        ena.release(AllocOp::Munmap, addr, size, RETURN_ADDRESS);
+    }
+    int ret = real_munmap(addr, size);
+    if (ret != 0) {
+        ena.release_failed();
+    }
+    return ret;
+}
+
+MALLOCVIS_EXPORT extern "C" void *mremap(void *old_addr, size_t old_size,
+                                         size_t new_size, int flags,
+                                         ...) CSTDLIB_NOEXCEPT {
+    void *new_addr = nullptr;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        new_addr = va_arg(args, void *);
+        va_end(args);
+    }
+    EnableGuard ena;
+    void *ptr = real_mremap(old_addr, old_size, new_size, flags, new_addr);
+    if (ena && ptr != MAP_FAILED) {
+#  ifdef MREMAP_DONTUNMAP
+        if (!(flags & MREMAP_DONTUNMAP))
+#  endif
+        {
+            ena.region(AllocOp::Munmap, old_addr, old_size, kNone,
+                       RETURN_ADDRESS);
+        }
+        ena.region(AllocOp::Mremap, ptr, new_size, kNone, RETURN_ADDRESS);
+    }
+    return ptr;
+}
+
+MALLOCVIS_EXPORT extern "C" int madvise(void *addr, size_t size,
+                                        int advice) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    int ret = real_madvise(addr, size, advice);
+    if (ena && ret == 0) {
+        ena.region(AllocOp::Madvise, addr, size, (size_t)advice,
+                   RETURN_ADDRESS);
+    }
+    return ret;
+}
+
+MALLOCVIS_EXPORT extern "C" void *sbrk(intptr_t increment) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    void *old_brk = real_sbrk(increment);
+    if (ena && old_brk != (void *)-1) {
+        ena.hook_caller = RETURN_ADDRESS;
+        ena.program_break((uintptr_t)old_brk,
+                          (uintptr_t)old_brk + increment);
+    }
+    return old_brk;
+}
+
+MALLOCVIS_EXPORT extern "C" int brk(void *addr) CSTDLIB_NOEXCEPT {
+    EnableGuard ena;
+    void *old_brk = ena ? real_sbrk(0) : nullptr;
+    int ret = real_brk(addr);
+    if (ena && ret == 0) {
+        ena.hook_caller = RETURN_ADDRESS;
+        ena.program_break((uintptr_t)old_brk, (uintptr_t)addr);
+    }
+    return ret;
+}
+# endif
+
+# if __unix__
+namespace {
+
+struct ThreadStartArgs {
+    void *(*routine)(void *);
+    void *arg;
+    ThreadOrigin origin;
+};
+
+// runs first on threads created through pthread_create, so that their
+// ThreadStart tells when, where and by whom they were created
+void *thread_trampoline(void *p) {
+    ThreadStartArgs args = *(ThreadStartArgs *)p;
+    REAL_LIBC(free)(p);
+    args.origin.start_time = global ? global->now() : 0;
+    thread_origin = args.origin;
+    return args.routine(args.arg);
+}
+
+} // namespace
+
+MALLOCVIS_EXPORT extern "C" int pthread_create(pthread_t *thread,
+                                               pthread_attr_t const *attr,
+                                               void *(*routine)(void *),
+                                               void *arg) CSTDLIB_NOEXCEPT {
+    using Create = int (*)(pthread_t *, pthread_attr_t const *,
+                           void *(*)(void *), void *);
+    static Create real_create = (Create)dlsym(RTLD_NEXT, "pthread_create");
+    if (!real_create) {
+        return EAGAIN;
+    }
+    ThreadStartArgs *args = nullptr;
+    if (global && global->thread_events) {
+        InternalScope internal;
+        args = (ThreadStartArgs *)REAL_LIBC(malloc)(sizeof(ThreadStartArgs));
+    }
+    if (!args) {
+        return real_create(thread, attr, routine, arg);
+    }
+    args->routine = routine;
+    args->arg = arg;
+    args->origin.creator = get_thread_id();
+    args->origin.caller = RETURN_ADDRESS;
+    {
+        EnableGuard ena;
+        args->origin.stack = ena ? ena.stack_of(RETURN_ADDRESS) : 0;
+    }
+    int ret = real_create(thread, attr, thread_trampoline, args);
+    if (ret) {
+        REAL_LIBC(free)(args);
+    }
+    return ret;
+}
+# endif
 #endif
 
 MALLOCVIS_EXPORT void operator delete(void *ptr) noexcept {
@@ -631,6 +3972,90 @@ MALLOCVIS_EXPORT void *operator new[](size_t size, std::align_val_t align,
 # endif
 #endif
 
+MALLOCVIS_EXPORT extern "C" void mallocvis_start(void) {
+    if (global) {
+        global->start();
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_stop(void) {
+    if (global) {
+        global->stop();
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_flush(void) {
+    if (global && !in_hook) {
+        in_hook = true;
+        global->flush();
+        in_hook = false;
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_report(char const *path) {
+    if (global && global->aggregating && !in_hook) {
+        in_hook = true;
+        global->write_report(
+            global->output_path(path ? path : global->options.report_path));
+        in_hook = false;
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_tag_push(char const *name) {
+    tag_stack.push(tag_stack.resolve(name));
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_tag_pop(void) {
+    tag_stack.pop();
+}
+
+MALLOCVIS_EXPORT extern "C" void mallocvis_marker(char const *name) {
+    uint32_t id = tag_stack.resolve(name);
+    EnableGuard ena;
+    if (ena) {
+        ena.mark(id, RETURN_ADDRESS);
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" unsigned mallocvis_resource_id(char const *name) {
+    if (!global || in_hook) {
+        return 0;
+    }
+    in_hook = true;
+    std::string unnamed;
+    if (!name) {
+        unnamed = "resource #" +
+                  std::to_string(global->unnamed_resources.fetch_add(
+                                     1, std::memory_order_relaxed) +
+                                 1);
+        name = unnamed.c_str();
+    }
+    char const *interned;
+    uint32_t id = global->intern_tag(name, interned);
+    in_hook = false;
+    return id;
+}
+
+MALLOCVIS_EXPORT extern "C" void
+mallocvis_resource_allocate(unsigned resource, void *ptr, size_t size,
+                            size_t align, void *caller) {
+    EnableGuard ena;
+    if (ena) {
+        ena.resource(AllocOp::ResourceAllocate, resource, ptr, size, align,
+                     caller);
+    }
+}
+
+MALLOCVIS_EXPORT extern "C" void
+mallocvis_resource_deallocate(unsigned resource, void *ptr, size_t size,
+                              size_t align, void *caller) {
+    EnableGuard ena;
+    if (ena) {
+        ena.resource(AllocOp::ResourceDeallocate, resource, ptr, size, align,
+                     caller);
+    }
+}
+
 #if MANUAL_GLOBAL_INIT
 alignas(GlobalData) static char global_buf[sizeof(GlobalData)];
 
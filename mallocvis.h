@@ -0,0 +1,118 @@
+#pragma once
+
+/* runtime control of a process traced by libmallocvis, usable from C */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* begins or resumes recording allocations */
+void mallocvis_start(void);
+/* pauses recording, events captured so far are kept */
+void mallocvis_stop(void);
+/* hands everything captured so far to the output, i.e. the stream file */
+void mallocvis_flush(void);
+
+/* tags the calling thread's allocations with `name` until the matching pop,
+ * tags nest and the innermost one is recorded */
+void mallocvis_tag_push(char const *name);
+void mallocvis_tag_pop(void);
+/* records a named point in time, drawn as a line across the plot */
+void mallocvis_marker(char const *name);
+
+/* under mode:aggregate, writes the per-callsite totals so far to `path`, or
+ * to the configured report path if NULL */
+void mallocvis_report(char const *path);
+
+/* records blocks served by an allocator the hooks do not see, such as a
+ * memory resource or an arena; `resource` comes from mallocvis_resource_id,
+ * which names it `name`, or "resource #<n>" if NULL */
+unsigned mallocvis_resource_id(char const *name);
+void mallocvis_resource_allocate(unsigned resource, void *ptr, size_t size,
+                                 size_t align, void *caller);
+void mallocvis_resource_deallocate(unsigned resource, void *ptr, size_t size,
+                                   size_t align, void *caller);
+
+#ifdef __cplusplus
+}
+
+# if __cplusplus >= 201703L && defined(__has_include)
+#  if __has_include(<memory_resource>)
+#   include <memory_resource>
+#  endif
+# endif
+# if defined(__GNUC__)
+#  define MALLOCVIS_RETURN_ADDRESS __builtin_return_address(0)
+# else
+#  define MALLOCVIS_RETURN_ADDRESS nullptr
+# endif
+
+namespace mallocvis {
+
+// tags allocations made by this thread while in scope, e.g.
+//   mallocvis::Scope scope("parse_request");
+struct Scope {
+    explicit Scope(char const *name) {
+        mallocvis_tag_push(name);
+    }
+
+    Scope(Scope &&) = delete;
+
+    ~Scope() {
+        mallocvis_tag_pop();
+    }
+};
+
+# if __cpp_lib_memory_resource
+// records every block `upstream` hands out through it, e.g.
+//   std::pmr::monotonic_buffer_resource arena;
+//   mallocvis::tracing_resource traced(&arena, "parser");
+//   std::pmr::vector<int> v(&traced);
+struct tracing_resource : std::pmr::memory_resource {
+    explicit tracing_resource(
+        std::pmr::memory_resource *upstream = std::pmr::get_default_resource(),
+        char const *name = nullptr)
+        : upstream(upstream),
+          id(mallocvis_resource_id(name)) {}
+
+    tracing_resource(tracing_resource &&) = delete;
+
+    std::pmr::memory_resource *upstream_resource() const {
+        return upstream;
+    }
+
+    unsigned resource_id() const {
+        return id;
+    }
+
+private:
+    std::pmr::memory_resource *upstream;
+    unsigned id;
+
+    void *do_allocate(size_t size, size_t align) override {
+        void *ptr = upstream->allocate(size, align);
+        mallocvis_resource_allocate(id, ptr, size, align,
+                                    MALLOCVIS_RETURN_ADDRESS);
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, size_t size, size_t align) override {
+        // recorded first, the block may be handed out again right after
+        mallocvis_resource_deallocate(id, ptr, size, align,
+                                      MALLOCVIS_RETURN_ADDRESS);
+        upstream->deallocate(ptr, size, align);
+    }
+
+    bool do_is_equal(
+        std::pmr::memory_resource const &other) const noexcept override {
+        return this == &other;
+    }
+};
+# endif
+
+} // namespace mallocvis
+
+# undef MALLOCVIS_RETURN_ADDRESS
+#endif
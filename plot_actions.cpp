@@ -10,18 +10,30 @@
 #if __cpp_lib_to_chars
 # include <charconv>
 #endif
+#include <cctype>
+#include <cerrno>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <map>
 #include <set>
 #include <sstream>
 #include <string>
+#include <tuple>
 #include <unordered_map>
+#if __unix__
+# include <unistd.h>
+#elif _WIN32
+# include <windows.h>
+#endif
 #undef min
 #undef max
 
@@ -38,6 +50,20 @@ struct LifeBlock {
     void *end_caller;
     int64_t start_time;
     int64_t end_time;
+    uint64_t weight;
+    uint32_t tag;
+    uint32_t resource;
+};
+
+// a span of address space mapped between two times, partial unmaps split
+// a mapping into pieces
+struct RegionBlock {
+    uintptr_t begin;
+    uintptr_t end;
+    int64_t start_time;
+    int64_t end_time;
+    AllocOp op;
+    void *caller;
 };
 
 struct LifeBlockCompare {
@@ -150,6 +176,16 @@ struct SvgWriter {
             << "\"" << alignment << ">" << html << "</text>\n";
     }
 
+    void polyline(std::vector<std::pair<double, double>> const &points,
+                  std::string const &color) {
+        out << "<polyline fill=\"none\" stroke=\"" << color
+            << "\" stroke-width=\"2\" points=\"";
+        for (auto const &[x, y]: points) {
+            out << x + margin << ',' << y << ' ';
+        }
+        out << "\"/>\n";
+    }
+
     SvgWriter(SvgWriter &&) = delete;
 
     ~SvgWriter() {
@@ -368,7 +404,32 @@ PlotOptions parse_plot_options_from_env() {
     if (!env) {
         return options;
     }
-    // MALLOCVIS=format:obj;path:/tmp/malloc.obj;height_scale:log;z_indicates:thread;layout:timeline;show_text:0;text_max_height:24;text_height_fraction:0.4;filter_cpp:1;filter_c:1;filter_cuda:1;svg_margin:420;svg_width:2000;svg_height:1460
+    // MALLOCVIS holds key:value pairs separated by ';', the plot options
+    // being, with their defaults (see PlotOptions):
+    //   format:svg               or obj or console, else from path's suffix
+    //   path:malloc.html         output file, malloc.obj for format:obj
+    //   height_scale:            linear or log, square root if unset
+    //   z_indicates:thread       depth by caller, tag or resource instead
+    //   color_indicates:caller   color by thread, tag or resource instead
+    //   layout:timeline          or address to place blocks by address
+    //   caller:user              first frame outside the library, or return
+    //   show_text:1              label blocks with their caller
+    //   text_max_height:24       largest label height in pixels
+    //   text_height_fraction:0.4 label height relative to the block
+    //   filter_c:1               0 hides that family of allocations
+    //   filter_cpp:1
+    //   filter_cuda:1
+    //   filter_pmr:1
+    //   tag:                     only plot blocks under this Scope
+    //   slowest:10               entries of the latency report
+    //   wasteful:10              entries of the fragmentation report
+    //   top_threads:10           entries of the thread report
+    //   cross_cpu:10             entries of the cross-CPU free report
+    //   svg_margin:420           SVG size in pixels
+    //   svg_width:2000
+    //   svg_height:1460
+    //   region_height:400        height of the lane drawn with mmap:1
+    //   counter_height:300       height of each chart drawn with counters
     std::string s(env);
     auto splits = string_split(s, ';');
     bool has_format = false;
@@ -411,53 +472,911 @@ PlotOptions parse_plot_options_from_env() {
                 options.z_indicates = PlotOptions::Thread;
             } else if (v == "caller") {
                 options.z_indicates = PlotOptions::Caller;
+            } else if (v == "tag") {
+                options.z_indicates = PlotOptions::Tag;
+            } else if (v == "resource") {
+                options.z_indicates = PlotOptions::Resource;
+            }
+        } else if (k == "color_indicates") {
+            if (v == "thread") {
+                options.color_indicates = PlotOptions::Thread;
+            } else if (v == "caller") {
+                options.color_indicates = PlotOptions::Caller;
+            } else if (v == "tag") {
+                options.color_indicates = PlotOptions::Tag;
+            } else if (v == "resource") {
+                options.color_indicates = PlotOptions::Resource;
             }
+        } else if (k == "tag") {
+            options.tag_filter = v;
+        } else if (k == "slowest") {
+            mallocvis_parse_option(k, v, options.slowest);
+        } else if (k == "wasteful") {
+            mallocvis_parse_option(k, v, options.wasteful);
+        } else if (k == "top_threads") {
+            mallocvis_parse_option(k, v, options.top_threads);
+        } else if (k == "cross_cpu") {
+            mallocvis_parse_option(k, v, options.cross_cpu);
         } else if (k == "layout") {
             if (v == "timeline") {
                 options.layout = PlotOptions::Timeline;
             } else if (v == "address") {
                 options.layout = PlotOptions::Address;
             }
+        } else if (k == "caller") {
+            if (v == "return") {
+                options.caller = PlotOptions::ReturnAddress;
+            } else if (v == "user") {
+                options.caller = PlotOptions::FirstUserFrame;
+            }
         } else if (k == "show_text") {
             options.show_text = v == "1";
         } else if (k == "text_max_height") {
-            options.text_max_height = std::stoi(v);
+            mallocvis_parse_option(k, v, options.text_max_height);
         } else if (k == "text_height_fraction") {
-            options.text_height_fraction = std::stod(v);
+            mallocvis_parse_option(k, v, options.text_height_fraction);
         } else if (k == "filter_cpp") {
             options.filter_cpp = v == "1";
         } else if (k == "filter_c") {
             options.filter_c = v == "1";
         } else if (k == "filter_cuda") {
             options.filter_cuda = v == "1";
+        } else if (k == "filter_pmr") {
+            options.filter_pmr = v == "1";
         } else if (k == "svg_margin") {
-            options.svg_margin = std::stoi(v);
+            mallocvis_parse_option(k, v, options.svg_margin);
         } else if (k == "svg_width") {
-            options.svg_width = std::stoi(v);
+            mallocvis_parse_option(k, v, options.svg_width);
         } else if (k == "svg_height") {
-            options.svg_height = std::stoi(v);
+            mallocvis_parse_option(k, v, options.svg_height);
+        } else if (k == "region_height") {
+            mallocvis_parse_option(k, v, options.region_height);
+        } else if (k == "counter_height") {
+            mallocvis_parse_option(k, v, options.counter_height);
         }
     }
     return options;
 }
 
+// tells whether a symbol from addr2sym belongs to the standard library or to
+// the allocation functions, judging by its qualified name
+bool is_library_symbol(std::string const &sym) {
+    static char const *const operators[] = {"operator new", "operator delete"};
+    for (auto prefix: operators) {
+        if (sym.rfind(prefix, 0) == 0) {
+            return true;
+        }
+    }
+    // strip the argument list and return type of demangled names
+    size_t end = sym.size();
+    int depth = 0;
+    for (size_t i = 0; i < sym.size(); ++i) {
+        if (sym[i] == '<') {
+            ++depth;
+        } else if (sym[i] == '>') {
+            --depth;
+        } else if (sym[i] == '(' && depth == 0 && i != 0) {
+            end = i;
+            break;
+        }
+    }
+    size_t begin = 0;
+    depth = 0;
+    for (size_t i = 0; i < end; ++i) {
+        if (sym[i] == '<') {
+            ++depth;
+        } else if (sym[i] == '>') {
+            --depth;
+        } else if (sym[i] == ' ' && depth == 0) {
+            begin = i + 1;
+        }
+    }
+    auto name = sym.substr(begin, end - begin);
+    static char const *const prefixes[] = {
+        "std::",   "__gnu_cxx::", "__cxxabiv1::", "__libc_",   "__cxa_",
+        "malloc",  "calloc",      "realloc",      "libstdc++", "libc.so",
+        "libc++",  "libmallocvis",
+    };
+    for (auto prefix: prefixes) {
+        if (name.rfind(prefix, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// replaces each caller by the first frame of its stack that is not part of
+// the standard library, so that container internals do not hide the site
+void resolve_user_callers(std::vector<AllocAction> &actions,
+                          std::vector<std::vector<void *>> const &stacks) {
+    std::cerr << "Resolving user frames of " << stacks.size()
+              << " stacks...\n";
+    std::unordered_map<void *, bool> is_library;
+    std::vector<void *> user_frames(stacks.size(), nullptr);
+    for (size_t id = 1; id < stacks.size(); ++id) {
+        for (void *frame: stacks[id]) {
+            auto it = is_library.find(frame);
+            if (it == is_library.end()) {
+                it = is_library
+                         .insert({frame, is_library_symbol(addr2sym(frame))})
+                         .first;
+            }
+            if (!it->second) {
+                user_frames[id] = frame;
+                break;
+            }
+        }
+    }
+    for (auto &action: actions) {
+        if (action.stack < user_frames.size() && user_frames[action.stack]) {
+            action.caller = user_frames[action.stack];
+        }
+    }
+}
+
+// replays region events in time order; mappings still alive at the end are
+// closed at end_time
+std::vector<RegionBlock> build_region_blocks(
+    std::vector<AllocAction> const &regions, int64_t end_time) {
+    auto page_end = [](uintptr_t p) -> uintptr_t {
+        return (p + 4095) & ~(uintptr_t)4095;
+    };
+    std::map<uintptr_t, RegionBlock> mapped;
+    std::vector<RegionBlock> blocks;
+    auto unmap = [&](uintptr_t begin, uintptr_t end, int64_t time) {
+        auto it = mapped.lower_bound(begin);
+        if (it != mapped.begin() && std::prev(it)->second.end > begin) {
+            --it;
+        }
+        while (it != mapped.end() && it->first < end) {
+            RegionBlock block = it->second;
+            it = mapped.erase(it);
+            if (block.begin < begin) {
+                RegionBlock left = block;
+                left.end = begin;
+                mapped.insert({left.begin, left});
+            }
+            if (block.end > end) {
+                RegionBlock right = block;
+                right.begin = end;
+                it = mapped.insert({right.begin, right}).first;
+            }
+            block.begin = std::max(block.begin, begin);
+            block.end = std::min(block.end, end);
+            block.end_time = time;
+            blocks.push_back(block);
+        }
+    };
+    for (auto const &action: regions) {
+        uintptr_t begin = (uintptr_t)action.ptr;
+        uintptr_t end = page_end(begin + action.size);
+        if (action.op == AllocOp::Munmap) {
+            unmap(begin, end, action.time);
+        } else if (kAllocOpIsAllocation[(size_t)action.op]) {
+            // a fixed mapping replaces whatever was there
+            unmap(begin, end, action.time);
+            mapped.insert({begin,
+                           {begin, end, action.time, action.time, action.op,
+                            action.caller}});
+        }
+    }
+    for (auto &[_, block]: mapped) {
+        block.end_time = end_time;
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
+// latencies at the given fractions of an ascending list, in nanoseconds
+std::string latency_percentiles(std::vector<int64_t> const &sorted) {
+    static double const fractions[] = {0.5, 0.9, 0.99, 0.999};
+    static char const *const names[] = {"p50", "p90", "p99", "p99.9"};
+    std::ostringstream ss;
+    ss << sorted.size() << " calls";
+    for (size_t i = 0; i < std::size(fractions); ++i) {
+        size_t rank = (size_t)(fractions[i] * (double)(sorted.size() - 1));
+        ss << ", " << names[i] << " " << sorted[rank] << "ns";
+    }
+    ss << ", max " << sorted.back() << "ns";
+    return ss.str();
+}
+
+// "0-3,8,10-11" as written in sysfs cpulist files
+std::vector<int> parse_cpu_list(std::string const &list) {
+    std::vector<int> cpus;
+    std::istringstream iss(list);
+    std::string range;
+    while (std::getline(iss, range, ',')) {
+        int first = 0;
+        int last = 0;
+        int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) {
+            continue;
+        }
+        for (int cpu = first; cpu <= (n == 2 ? last : first); ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// NUMA node of each CPU, from /sys/devices/system/node; empty where that is
+// not available, as is the node of a CPU it does not list
+std::vector<int> read_cpu_nodes() {
+    std::vector<int> nodes;
+    auto read_list = [](std::string const &path) {
+        std::ifstream in(path);
+        std::string list;
+        std::getline(in, list);
+        return parse_cpu_list(list);
+    };
+    for (int node: read_list("/sys/devices/system/node/online")) {
+        for (int cpu: read_list("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist")) {
+            if ((size_t)cpu >= nodes.size()) {
+                nodes.resize(cpu + 1, -1);
+            }
+            nodes[cpu] = node;
+        }
+    }
+    return nodes;
+}
+
+// how often blocks are freed on another CPU, or another NUMA node, than the
+// one that allocated them, overall and per allocating callsite, for actions
+// captured with cpu:1; on a single node only CPUs are compared
+void print_cpu_report(std::vector<AllocAction> const &actions,
+                      size_t cross_cpu) {
+    struct CrossTotal {
+        double frees = 0;
+        double cross_cpu = 0;
+        double cross_node = 0;
+    };
+    struct Allocated {
+        void *caller;
+        uint32_t cpu;
+    };
+    std::map<std::pair<void *, uint32_t>, Allocated> living;
+    std::vector<int> nodes;
+    bool captured = false;
+    CrossTotal total;
+    std::unordered_map<void *, CrossTotal> by_caller;
+    auto node_of = [&](uint32_t cpu) {
+        return cpu - 1 < nodes.size() ? nodes[cpu - 1] : -1;
+    };
+    for (auto const &action: actions) {
+        if (!action.cpu || kAllocOpIsRegion[(size_t)action.op]) {
+            continue;
+        }
+        if (!captured) {
+            captured = true;
+            nodes = read_cpu_nodes();
+        }
+        std::pair<void *, uint32_t> key{action.ptr, action.resource};
+        if (kAllocOpIsAllocation[(size_t)action.op]) {
+            living[key] = {action.caller, action.cpu};
+            continue;
+        }
+        auto it = living.find(key);
+        if (it == living.end()) {
+            continue;
+        }
+        auto [caller, cpu] = it->second;
+        living.erase(it);
+        int node = node_of(cpu);
+        bool other_cpu = cpu != action.cpu;
+        bool other_node =
+            other_cpu && node >= 0 && node != node_of(action.cpu) &&
+            node_of(action.cpu) >= 0;
+        for (CrossTotal *t: {&total, &by_caller[caller]}) {
+            t->frees += 1;
+            t->cross_cpu += other_cpu;
+            t->cross_node += other_node;
+        }
+    }
+    if (!captured || !total.frees) {
+        return;
+    }
+    std::set<int> distinct(nodes.begin(), nodes.end());
+    distinct.erase(-1);
+    bool numa = distinct.size() > 1;
+    auto describe = [&](CrossTotal const &t) {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(0) << t.frees << " frees, "
+           << std::setprecision(1) << 100 * t.cross_cpu / t.frees
+           << "% on another CPU";
+        if (numa) {
+            ss << ", " << 100 * t.cross_node / t.frees
+               << "% on another node";
+        }
+        return ss.str();
+    };
+    std::cerr << "Frees across CPUs: " << describe(total);
+    if (numa) {
+        std::cerr << " of " << distinct.size() << " nodes\n";
+    } else {
+        std::cerr << ", single NUMA node\n";
+    }
+    std::vector<std::tuple<double, double, double, void *>> sorted;
+    for (auto const &[caller, t]: by_caller) {
+        sorted.push_back({t.cross_node, t.cross_cpu, t.frees, caller});
+    }
+    std::sort(sorted.begin(), sorted.end(), std::greater<>());
+    if (sorted.size() > cross_cpu) {
+        sorted.resize(cross_cpu);
+    }
+    std::cerr << "Frees across CPUs by allocating caller, most "
+              << (numa ? "across nodes" : "across CPUs") << " first:\n";
+    for (auto const &entry: sorted) {
+        void *caller = std::get<3>(entry);
+        std::cerr << "  " << addr2sym(caller) << ": "
+                  << describe(by_caller[caller]) << "\n";
+    }
+}
+
+// what the ThreadStart and ThreadExit of a thread tell, and the heap
+// allocations it made
+struct ThreadInfo {
+    std::string name;
+    uint32_t creator = 0;
+    int64_t start_time = 0;
+    int64_t exit_time = 0;
+    bool started = false;
+    bool exited = false;
+    double allocations = 0;
+    double bytes = 0;
+};
+
+using ThreadTable = std::map<uint32_t, ThreadInfo>;
+
+// the name at exit wins over the name at start, as threads are often named
+// after they first allocate
+ThreadTable collect_threads(std::vector<AllocAction> const &actions,
+                            std::vector<std::string> const &tags) {
+    ThreadTable threads;
+    auto set_name = [&](ThreadInfo &thread, uint32_t tag) {
+        if (tag && tag < tags.size()) {
+            thread.name = tags[tag];
+        }
+    };
+    for (auto const &action: actions) {
+        if (action.op == AllocOp::ThreadStart) {
+            auto &thread = threads[action.tid];
+            thread.started = true;
+            thread.start_time = action.time;
+            thread.creator = action.size != kNone ? (uint32_t)action.size : 0;
+            if (thread.name.empty()) {
+                set_name(thread, action.tag);
+            }
+        } else if (action.op == AllocOp::ThreadExit) {
+            auto &thread = threads[action.tid];
+            thread.exited = true;
+            thread.exit_time = action.time;
+            set_name(thread, action.tag);
+        } else if (kAllocOpIsAllocation[(size_t)action.op] &&
+                   !kAllocOpIsRegion[(size_t)action.op] &&
+                   !kAllocOpIsResource[(size_t)action.op]) {
+            // a sampled allocation stands for weight / size of its kind
+            auto &thread = threads[action.tid];
+            double n = action.weight && action.size
+                           ? (double)action.weight / (double)action.size
+                           : 1.0;
+            thread.allocations += n;
+            thread.bytes += n * (double)action.size;
+        }
+    }
+    return threads;
+}
+
+// "worker-17 (1234)", or the bare tid of a thread without a name
+std::string thread_label(ThreadTable const &threads, uint32_t tid) {
+    auto it = threads.find(tid);
+    if (it == threads.end() || it->second.name.empty()) {
+        return std::to_string(tid);
+    }
+    return it->second.name + " (" + std::to_string(tid) + ")";
+}
+
+// the busiest threads, and threads grouped by name with any trailing number
+// dropped and by the group of their creator, so that a pool of short-lived
+// threads shows up as one line with its share of the allocations
+void print_thread_report(ThreadTable const &threads, int64_t end_time,
+                         size_t top) {
+    size_t started = 0;
+    size_t exited = 0;
+    double total = 0;
+    for (auto const &[_, thread]: threads) {
+        started += thread.started;
+        exited += thread.exited;
+        total += thread.allocations;
+    }
+    if (!started || !top) {
+        return;
+    }
+    auto lifetime_ms = [&](ThreadInfo const &thread) {
+        return (double)((thread.exited ? thread.exit_time : end_time) -
+                        thread.start_time) *
+               1e-6;
+    };
+    // formatted apart, so that the fixed precisions do not stick to cerr
+    std::ostringstream out;
+    out << "Threads: " << started << " started, " << exited << " exited\n";
+    std::vector<std::pair<double, uint32_t>> busiest;
+    for (auto const &[tid, thread]: threads) {
+        busiest.push_back({thread.allocations, tid});
+    }
+    std::sort(busiest.begin(), busiest.end(), std::greater<>());
+    if (busiest.size() > top) {
+        busiest.resize(top);
+    }
+    out << std::fixed;
+    for (auto const &[_, tid]: busiest) {
+        auto const &thread = threads.at(tid);
+        out << "  " << thread_label(threads, tid);
+        if (thread.creator) {
+            out << ", created by " << thread_label(threads, thread.creator);
+        }
+        out << std::setprecision(0) << ": " << thread.allocations
+            << " allocations, " << thread.bytes << " bytes";
+        if (thread.started) {
+            out << std::setprecision(3) << ", "
+                << (thread.exited ? "lived " : "alive for ")
+                << lifetime_ms(thread) << "ms";
+        }
+        out << "\n";
+    }
+
+    auto stem = [&](uint32_t tid) -> std::string {
+        auto it = threads.find(tid);
+        if (it == threads.end()) {
+            return "";
+        }
+        std::string name = it->second.name;
+        while (!name.empty() && (std::isdigit((unsigned char)name.back()) ||
+                                 std::strchr("-_#.: ", name.back()))) {
+            name.pop_back();
+        }
+        if (name.size() < it->second.name.size()) {
+            name += "*";
+        }
+        return name;
+    };
+    struct Group {
+        size_t threads = 0;
+        double lifetime_ms = 0;
+        double allocations = 0;
+    };
+    std::map<std::pair<std::string, std::string>, Group> groups;
+    for (auto const &[tid, thread]: threads) {
+        if (!thread.started) {
+            continue;
+        }
+        auto &group = groups[{stem(tid),
+                              thread.creator ? stem(thread.creator) : ""}];
+        ++group.threads;
+        group.lifetime_ms += lifetime_ms(thread);
+        group.allocations += thread.allocations;
+    }
+    std::vector<std::pair<double, decltype(groups)::const_iterator>> sorted;
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+        if (it->second.threads > 1) {
+            sorted.push_back({it->second.allocations, it});
+        }
+    }
+    if (sorted.empty()) {
+        std::cerr << out.str();
+        return;
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](auto const &a, auto const &b) { return a.first > b.first; });
+    if (sorted.size() > top) {
+        sorted.resize(top);
+    }
+    out << "Thread groups by allocations:\n";
+    for (auto const &[_, it]: sorted) {
+        auto const &[key, group] = *it;
+        out << "  " << (key.first.empty() ? "(unnamed)" : key.first);
+        if (!key.second.empty()) {
+            out << " created by " << key.second;
+        }
+        out << std::setprecision(3) << ": " << group.threads
+            << " threads, lived " << group.lifetime_ms / group.threads
+            << "ms on average, " << std::setprecision(0)
+            << group.allocations << " allocations ("
+            << std::setprecision(1)
+            << (total ? 100 * group.allocations / total : 0) << "%)\n";
+    }
+    std::cerr << out.str();
+}
+
+// percentiles of the time spent in the allocator per op and per caller, and
+// the slowest calls, for actions captured with latency:1
+void print_latency_report(std::vector<AllocAction> const &actions,
+                          ThreadTable const &threads, size_t slowest) {
+    std::map<AllocOp, std::vector<int64_t>> by_op;
+    std::unordered_map<void *, std::vector<int64_t>> by_caller;
+    std::vector<AllocAction const *> timed;
+    for (auto const &action: actions) {
+        if (action.latency > 0) {
+            by_op[action.op].push_back(action.latency);
+            by_caller[action.caller].push_back(action.latency);
+            timed.push_back(&action);
+        }
+    }
+    if (timed.empty()) {
+        return;
+    }
+
+    std::cerr << "Allocator latency by op:\n";
+    for (auto &[op, latencies]: by_op) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cerr << "  " << kAllocOpNames[(size_t)op] << ": "
+                  << latency_percentiles(latencies) << "\n";
+    }
+
+    // callers ranked by their tail, as that is what stalls the program
+    std::vector<std::pair<int64_t, void *>> callers;
+    for (auto &[caller, latencies]: by_caller) {
+        std::sort(latencies.begin(), latencies.end());
+        size_t rank = (size_t)(0.99 * (double)(latencies.size() - 1));
+        callers.push_back({latencies[rank], caller});
+    }
+    std::sort(callers.begin(), callers.end(), std::greater<>());
+    if (callers.size() > slowest) {
+        callers.resize(slowest);
+    }
+    std::cerr << "Allocator latency by caller, highest p99 first:\n";
+    for (auto const &[_, caller]: callers) {
+        std::cerr << "  " << addr2sym(caller) << ": "
+                  << latency_percentiles(by_caller[caller]) << "\n";
+    }
+
+    size_t num_slowest = std::min(slowest, timed.size());
+    std::partial_sort(timed.begin(), timed.begin() + num_slowest, timed.end(),
+                      [](AllocAction const *a, AllocAction const *b) {
+                          return a->latency > b->latency;
+                      });
+    int64_t time0 = actions.front().time;
+    std::cerr << "Slowest allocator calls:\n";
+    for (size_t i = 0; i < num_slowest; ++i) {
+        auto const &action = *timed[i];
+        std::cerr << "  " << action.latency << "ns "
+                  << kAllocOpNames[(size_t)action.op];
+        if (action.size != kNone) {
+            std::cerr << " of " << action.size << " bytes";
+        }
+        std::cerr << " by thread " << thread_label(threads, action.tid)
+                  << " at "
+                  << (action.time - time0) << "ns from "
+                  << addr2sym(action.caller) << "\n";
+    }
+}
+
+struct WasteTotal {
+    double count = 0;
+    double requested = 0;
+    double consumed = 0;
+    size_t min_size = (size_t)-1;
+    size_t max_size = 0;
+
+    void add(AllocAction const &action) {
+        // a sampled allocation stands for weight / size of its kind
+        double n = action.weight && action.size
+                       ? (double)action.weight / (double)action.size
+                       : 1.0;
+        count += n;
+        requested += n * (double)action.size;
+        consumed += n * (double)(action.size + action.slack);
+        min_size = std::min(min_size, action.size);
+        max_size = std::max(max_size, action.size);
+    }
+
+    std::string describe() const {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(0) << count << " allocs, "
+           << requested << " bytes requested, " << consumed
+           << " consumed, " << consumed - requested << " wasted ("
+           << std::setprecision(1)
+           << (consumed ? 100 * (consumed - requested) / consumed : 0) << "%)";
+        return ss.str();
+    }
+};
+
+// bytes requested vs bytes the allocator handed out, overall, per caller and
+// per size class (allocations of the same usable size), for actions captured
+// with usable:1
+void print_fragmentation_report(std::vector<AllocAction> const &actions,
+                                size_t wasteful) {
+    WasteTotal total;
+    std::unordered_map<void *, WasteTotal> by_caller;
+    std::map<size_t, WasteTotal> by_class;
+    bool captured = false;
+    for (auto const &action: actions) {
+        if (!kAllocOpIsAllocation[(size_t)action.op] ||
+            !(kAllocOpIsC[(size_t)action.op] ||
+              kAllocOpIsCpp[(size_t)action.op])) {
+            continue;
+        }
+        captured |= action.slack != 0;
+        total.add(action);
+        by_caller[action.caller].add(action);
+        by_class[action.size + action.slack].add(action);
+    }
+    if (!captured) {
+        return;
+    }
+
+    auto most_wasted = [&](auto const &totals) {
+        using Key = typename std::decay_t<decltype(totals)>::key_type;
+        std::vector<std::pair<double, Key>> sorted;
+        for (auto const &[key, waste]: totals) {
+            sorted.push_back({waste.consumed - waste.requested, key});
+        }
+        std::sort(sorted.begin(), sorted.end(), std::greater<>());
+        if (sorted.size() > wasteful) {
+            sorted.resize(wasteful);
+        }
+        return sorted;
+    };
+    std::cerr << "Internal fragmentation: " << total.describe() << "\n";
+    std::cerr << "Internal fragmentation by caller, most wasted first:\n";
+    for (auto const &[_, caller]: most_wasted(by_caller)) {
+        std::cerr << "  " << addr2sym(caller) << ": "
+                  << by_caller[caller].describe() << "\n";
+    }
+    std::cerr << "Internal fragmentation by size class, most wasted first:\n";
+    for (auto const &[_, usable]: most_wasted(by_class)) {
+        auto const &waste = by_class[usable];
+        std::cerr << "  " << usable << " bytes, for requests of "
+                  << waste.min_size;
+        if (waste.max_size != waste.min_size) {
+            std::cerr << " to " << waste.max_size;
+        }
+        std::cerr << " bytes: " << waste.describe() << "\n";
+    }
+}
+
+// timestamps of different threads may tie, or even run backwards, between
+// the free of a block and its reuse; where the trace has sequence numbers,
+// the events of each block are put in their order on the positions the time
+// sort gave them, and delayed to at least the time of the event before
+void order_by_sequence(std::vector<AllocAction> &actions) {
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < actions.size(); ++i) {
+        if (actions[i].seq) {
+            indices.push_back(i);
+        }
+    }
+    if (indices.empty()) {
+        return;
+    }
+    auto key = [&](size_t i) {
+        return std::make_pair(actions[i].ptr, actions[i].resource);
+    };
+    std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+        return key(a) < key(b);
+    });
+    std::vector<AllocAction> group;
+    for (size_t begin = 0, end; begin < indices.size(); begin = end) {
+        end = begin + 1;
+        while (end < indices.size() &&
+               key(indices[end]) == key(indices[begin])) {
+            ++end;
+        }
+        if (end - begin < 2) {
+            continue;
+        }
+        group.clear();
+        for (size_t j = begin; j < end; ++j) {
+            group.push_back(actions[indices[j]]);
+        }
+        std::sort(group.begin(), group.end(),
+                  [](AllocAction const &a, AllocAction const &b) {
+                      return a.seq < b.seq;
+                  });
+        for (size_t j = 1; j < group.size(); ++j) {
+            group[j].time = std::max(group[j].time, group[j - 1].time);
+        }
+        for (size_t j = begin; j < end; ++j) {
+            actions[indices[j]] = group[j - begin];
+        }
+    }
+    std::stable_sort(actions.begin(), actions.end(),
+                     [](AllocAction const &a, AllocAction const &b) {
+                         return a.time < b.time;
+                     });
+}
+
 } // namespace
 
+namespace {
+void report_bad_option(std::string const &k, std::string const &v) {
+    std::cerr << "mallocvis: ignoring " << k << ":" << v
+              << ", not a valid number\n";
+}
+} // namespace
+
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            size_t &out) {
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long n = std::strtoull(v.c_str(), &end, 10);
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; ++end; break;
+    case 'm': case 'M': shift = 20; ++end; break;
+    case 'g': case 'G': shift = 30; ++end; break;
+    }
+    if (v.empty() || !std::isdigit((unsigned char)v[0]) || *end || errno ||
+        n > (std::numeric_limits<size_t>::max() >> shift)) {
+        report_bad_option(k, v);
+        return false;
+    }
+    out = (size_t)n << shift;
+    return true;
+}
+
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            int64_t &out) {
+    char *end = nullptr;
+    errno = 0;
+    long long n = std::strtoll(v.c_str(), &end, 10);
+    if (v.empty() || *end || errno) {
+        report_bad_option(k, v);
+        return false;
+    }
+    out = (int64_t)n;
+    return true;
+}
+
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            double &out) {
+    char *end = nullptr;
+    errno = 0;
+    double n = std::strtod(v.c_str(), &end);
+    if (v.empty() || *end || errno) {
+        report_bad_option(k, v);
+        return false;
+    }
+    out = n;
+    return true;
+}
+
 void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
+    mallocvis_plot_alloc_actions(std::move(actions), {});
+}
+
+std::string mallocvis_output_path(std::string const &path, bool forked) {
+#if __unix__
+    std::string pid = std::to_string(getpid());
+#elif _WIN32
+    std::string pid = std::to_string(GetCurrentProcessId());
+#else
+    std::string pid = "0";
+#endif
+    std::string result;
+    bool expanded = false;
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] == '%' && i + 1 < path.size() && path[i + 1] == 'p') {
+            result += pid;
+            expanded = true;
+            ++i;
+        } else {
+            result += path[i];
+        }
+    }
+    if (forked && !expanded) {
+        size_t slash = result.find_last_of("/\\");
+        size_t dot = result.rfind('.');
+        if (dot == std::string::npos ||
+            (slash != std::string::npos && dot < slash)) {
+            dot = result.size();
+        }
+        result.insert(dot, "." + pid);
+    }
+    return result;
+}
+
+void mallocvis_plot_alloc_actions(
+    std::vector<AllocAction> actions,
+    std::vector<std::vector<void *>> const &stacks,
+    std::vector<std::string> const &tags, bool forked) {
     PlotOptions options = parse_plot_options_from_env();
+    if (options.path.empty()) {
+        options.path = options.format == PlotOptions::Obj ? "malloc.obj"
+                                                          : "malloc.html";
+    }
+    options.path = mallocvis_output_path(options.path, forked);
+    auto tag_name = [&](uint32_t tag) -> std::string {
+        return tag < tags.size() ? tags[tag] : "";
+    };
 
     if (actions.empty()) {
         return;
     }
+    if (options.caller == PlotOptions::FirstUserFrame && stacks.size() > 1) {
+        resolve_user_callers(actions, stacks);
+    }
     std::sort(actions.begin(), actions.end(),
               [](AllocAction const &a, AllocAction const &b) {
                   return a.time < b.time;
               });
+    order_by_sequence(actions);
+    ThreadTable threads = collect_threads(actions, tags);
+    print_latency_report(actions, threads, options.slowest);
+    print_fragmentation_report(actions, options.wasteful);
+    print_thread_report(threads, actions.back().time, options.top_threads);
+    print_cpu_report(actions, options.cross_cpu);
+
+    uint32_t only_tag = 0;
+    if (!options.tag_filter.empty()) {
+        auto it = std::find(tags.begin(), tags.end(), options.tag_filter);
+        if (it == tags.end() || it == tags.begin()) {
+            std::cerr << "No allocations tagged " << options.tag_filter
+                      << "\n";
+            return;
+        }
+        only_tag = (uint32_t)(it - tags.begin());
+    }
 
     std::cerr << "Ploting " << actions.size() << " actions...\n";
-    std::map<void *, LifeBlock> living;
+    // a resource block may share its address with the heap block it was
+    // carved from, so blocks are told apart by resource too
+    std::map<std::pair<void *, uint32_t>, LifeBlock> living;
     std::set<LifeBlock, LifeBlockCompare> dead;
+    std::vector<std::pair<int64_t, uint32_t>> markers;
+    std::vector<AllocAction> regions;
+    // sampled counters by CounterKind, and the traced live bytes next to
+    // them, kept at one point per pixel of the timeline
+    using Series = std::vector<std::pair<int64_t, double>>;
+    std::map<size_t, Series> counters;
+    Series live_bytes;
+    bool has_counters = std::any_of(
+        actions.begin(), actions.end(), [](AllocAction const &action) {
+            return action.op == AllocOp::Counter;
+        });
+    double live = 0;
+    // live and peak live bytes of each tracing_resource
+    std::map<uint32_t, std::pair<double, double>> resource_live;
+    auto track_resource = [&](uint32_t resource, double delta) {
+        auto &[bytes, peak] = resource_live[resource];
+        bytes += delta;
+        peak = std::max(peak, bytes);
+    };
+    double time_to_pixel =
+        options.svg_width /
+        (double)(actions.back().time - actions.front().time + 1);
+    auto track_live = [&](int64_t time, double delta) {
+        live += delta;
+        if (!live_bytes.empty() &&
+            (int64_t)((live_bytes.back().first - actions.front().time) *
+                      time_to_pixel) ==
+                (int64_t)((time - actions.front().time) * time_to_pixel)) {
+            live_bytes.back().second = std::max(live_bytes.back().second, live);
+        } else {
+            live_bytes.push_back({time, live});
+        }
+    };
     for (auto const &action: actions) {
+        if (action.op == AllocOp::Marker) {
+            markers.push_back({action.time, action.tag});
+            continue;
+        }
+        if (action.op == AllocOp::ThreadStart ||
+            action.op == AllocOp::ThreadExit) {
+            continue;
+        }
+        if (action.op == AllocOp::Counter) {
+            if (action.align < (size_t)CounterKind::Unknown) {
+                counters[action.align].push_back(
+                    {action.time, (double)action.size});
+            }
+            continue;
+        }
+        if (kAllocOpIsRegion[(size_t)action.op]) {
+            regions.push_back(action);
+            continue;
+        }
         if (!options.filter_c && kAllocOpIsC[(size_t)action.op]) {
             continue;
         }
@@ -467,14 +1386,39 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
         if (!options.filter_cuda && kAllocOpIsCpp[(size_t)action.op]) {
             continue;
         }
+        if (!options.filter_pmr && kAllocOpIsResource[(size_t)action.op]) {
+            continue;
+        }
+        // resource blocks live inside heap blocks already counted
+        bool counts_live =
+            has_counters && !kAllocOpIsResource[(size_t)action.op];
         if (kAllocOpIsAllocation[(size_t)action.op]) {
-            living.insert({action.ptr,
-                           {action.op, action.op, action.tid, action.tid,
-                            action.ptr, action.size, action.caller,
-                            action.caller, action.time, action.time}});
+            if (only_tag && action.tag != only_tag) {
+                continue;
+            }
+            bool inserted =
+                living
+                    .insert({{action.ptr, action.resource},
+                             {action.op, action.op, action.tid, action.tid,
+                              action.ptr, action.size, action.caller,
+                              action.caller, action.time, action.time,
+                              action.weight, action.tag, action.resource}})
+                    .second;
+            if (counts_live && inserted) {
+                track_live(action.time, (double)action.size);
+            }
+            if (action.resource && inserted) {
+                track_resource(action.resource, (double)action.size);
+            }
         } else {
-            auto it = living.find(action.ptr);
+            auto it = living.find({action.ptr, action.resource});
             if (it != living.end()) {
+                if (counts_live) {
+                    track_live(action.time, -(double)it->second.size);
+                }
+                if (action.resource) {
+                    track_resource(action.resource, -(double)it->second.size);
+                }
                 it->second.end_op = action.op;
                 it->second.end_tid = action.tid;
                 it->second.end_time = action.time;
@@ -485,6 +1429,134 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
         }
     }
 
+    // a sampled allocation of `weight` bytes stands for weight / size
+    // allocations of its size, which keeps these totals unbiased
+    size_t num_sampled = 0;
+    double estimated_count = 0;
+    double estimated_bytes = 0;
+    double estimated_leaked = 0;
+    auto add_estimate = [&](LifeBlock const &block, bool leaked) {
+        if (block.weight) {
+            ++num_sampled;
+            double count = block.size
+                               ? (double)block.weight / (double)block.size
+                               : 1.0;
+            estimated_count += count;
+            estimated_bytes += (double)block.weight;
+            if (leaked) {
+                estimated_leaked += (double)block.weight;
+            }
+        }
+    };
+    for (auto const &block: dead) {
+        add_estimate(block, false);
+    }
+    for (auto const &[_, block]: living) {
+        add_estimate(block, true);
+    }
+    // the tag table also names markers, resources and threads
+    bool has_scope_tags = std::any_of(
+        actions.begin(), actions.end(), [](AllocAction const &action) {
+            return action.tag && kAllocOpIsAllocation[(size_t)action.op];
+        });
+    if (has_scope_tags) {
+        struct TagTotal {
+            size_t count = 0;
+            double bytes = 0;
+            double alive = 0;
+        };
+        std::map<uint32_t, TagTotal> totals;
+        auto add_total = [&](LifeBlock const &block, bool leaked) {
+            // resource blocks are already counted in their heap blocks
+            if (block.resource) {
+                return;
+            }
+            auto &total = totals[block.tag];
+            ++total.count;
+            double bytes =
+                block.weight ? (double)block.weight : (double)block.size;
+            total.bytes += bytes;
+            if (leaked) {
+                total.alive += bytes;
+            }
+        };
+        for (auto const &block: dead) {
+            add_total(block, false);
+        }
+        for (auto const &[_, block]: living) {
+            add_total(block, true);
+        }
+        std::vector<std::pair<uint32_t, TagTotal>> sorted(totals.begin(),
+                                                          totals.end());
+        std::sort(sorted.begin(), sorted.end(),
+                  [](auto const &a, auto const &b) {
+                      return a.second.bytes > b.second.bytes;
+                  });
+        for (auto const &[tag, total]: sorted) {
+            std::cerr << "Tag " << (tag ? tag_name(tag) : "(none)") << ": "
+                      << total.count << " allocations, "
+                      << (uint64_t)total.bytes << " bytes, "
+                      << (uint64_t)total.alive << " bytes alive at exit\n";
+        }
+    }
+    if (!resource_live.empty()) {
+        // how much each arena serves, to compare with what it holds
+        std::map<uint32_t, std::pair<size_t, uint64_t>> totals;
+        for (auto const &block: dead) {
+            if (block.resource) {
+                ++totals[block.resource].first;
+                totals[block.resource].second += block.size;
+            }
+        }
+        for (auto const &[_, block]: living) {
+            if (block.resource) {
+                ++totals[block.resource].first;
+                totals[block.resource].second += block.size;
+            }
+        }
+        for (auto const &[resource, total]: totals) {
+            auto [bytes, peak] = resource_live[resource];
+            std::cerr << "Resource " << tag_name(resource) << ": "
+                      << total.first << " allocations, " << total.second
+                      << " bytes, " << (uint64_t)peak << " bytes peak live, "
+                      << (uint64_t)bytes << " bytes alive at exit\n";
+        }
+    }
+    if (!regions.empty()) {
+        std::map<AllocOp, std::pair<size_t, uint64_t>> totals;
+        for (auto const &action: regions) {
+            auto &total = totals[action.op];
+            ++total.first;
+            total.second += action.size;
+        }
+        for (auto const &[op, total]: totals) {
+            std::cerr << kAllocOpNames[(size_t)op] << ": " << total.first
+                      << " calls, " << total.second << " bytes\n";
+        }
+    }
+    if (!counters.empty()) {
+        auto peak = [](Series const &series) {
+            double value = 0;
+            for (auto const &point: series) {
+                value = std::max(value, point.second);
+            }
+            return (uint64_t)value;
+        };
+        for (auto const &[kind, series]: counters) {
+            std::cerr << kCounterKindNames[kind] << ": "
+                      << (uint64_t)series.back().second << " at exit, "
+                      << peak(series) << " at peak\n";
+        }
+        std::cerr << "Traced live bytes: " << (uint64_t)live << " at exit, "
+                  << peak(live_bytes) << " at peak\n";
+    }
+    if (num_sampled) {
+        std::cerr << "Sampled " << num_sampled << " allocations, estimated "
+                  << (uint64_t)estimated_count << " allocations of "
+                  << (uint64_t)estimated_bytes << " bytes, "
+                  << (uint64_t)estimated_leaked << " bytes alive at exit\n";
+    }
+
     double (*eval_height)(LifeBlock const &);
     if (options.height_scale == PlotOptions::Log) {
         eval_height = [](LifeBlock const &block) -> double {
@@ -522,6 +1594,14 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
         tids.insert({block.start_tid, tids.size()});
         tids.insert({block.end_tid, tids.size()});
     }
+    for (auto const &action: regions) {
+        start_time = std::min(start_time, action.time);
+        end_time = std::max(end_time, action.time);
+    }
+    for (auto const &[_, series]: counters) {
+        start_time = std::min(start_time, series.front().first);
+        end_time = std::max(end_time, series.back().first);
+    }
 
     std::cerr << "Searching for leakage...\n";
     for (auto &[_, block]: living) {
@@ -545,7 +1625,7 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
     }
 
     if (options.format == PlotOptions::Obj) {
-        ObjWriter obj(options.path.empty() ? "malloc.obj" : options.path);
+        ObjWriter obj(options.path);
         double time_scale = 1.0 / (end_time - start_time);
         double caller_scale = 1.0 / (end_caller - start_caller);
 
@@ -569,6 +1649,10 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
             } else if (options.z_indicates == PlotOptions::Thread) {
                 z0 = tids.at(block.start_tid);
                 z1 = tids.at(block.end_tid);
+            } else if (options.z_indicates == PlotOptions::Tag) {
+                z0 = z1 = block.tag;
+            } else if (options.z_indicates == PlotOptions::Resource) {
+                z0 = z1 = block.resource;
             }
             return {z0, z1};
         };
@@ -634,17 +1718,127 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
 
         auto eval_color =
             [&](LifeBlock const &block) -> std::pair<std::string, std::string> {
+            if (options.color_indicates == PlotOptions::Tag ||
+                options.color_indicates == PlotOptions::Resource) {
+                // resources are named in the tag table, heap blocks are gray
+                uint32_t id = options.color_indicates == PlotOptions::Tag
+                                  ? block.tag
+                                  : block.resource;
+                if (!id || tags.size() < 2) {
+                    return {"gray", "gray"};
+                }
+                auto color =
+                    hsvToRgb((id - 1) * 1.0 / (tags.size() - 1), 0.7, 0.7);
+                return {color, color};
+            } else if (options.color_indicates == PlotOptions::Thread) {
+                return {hsvToRgb(tids.at(block.start_tid) * 1.0 / tids.size(),
+                                 0.7, 0.7),
+                        hsvToRgb(tids.at(block.end_tid) * 1.0 / tids.size(),
+                                 0.7, 0.7)};
+            }
             return {caller_color(block.start_caller),
                     caller_color(block.end_caller)};
         };
 
         auto eval_text =
-            [](LifeBlock const &block) -> std::pair<std::string, std::string> {
+            [&](LifeBlock const &block) -> std::pair<std::string, std::string> {
+            if (options.color_indicates == PlotOptions::Thread) {
+                return {thread_label(threads, block.start_tid),
+                        thread_label(threads, block.end_tid)};
+            }
             return {addr2sym(block.start_caller), addr2sym(block.end_caller)};
         };
 
-        SvgWriter svg(options.path.empty() ? "malloc.html" : options.path,
-                      total_width, total_height, options.svg_margin);
+        // the address space lane stacks clusters of overlapping mappings in
+        // address order, leaving out the gaps between them
+        std::vector<RegionBlock> region_blocks;
+        std::vector<std::pair<uintptr_t, uintptr_t>> clusters;
+        std::vector<double> cluster_y;
+        std::vector<double> cluster_height;
+        double lane_top = total_height + options.text_max_height;
+        double full_height = total_height;
+        if (!regions.empty() && options.region_height) {
+            region_blocks = build_region_blocks(regions, end_time);
+            std::vector<std::pair<uintptr_t, uintptr_t>> spans;
+            for (auto const &block: region_blocks) {
+                spans.push_back({block.begin, block.end});
+            }
+            for (auto const &action: regions) {
+                if (action.op == AllocOp::Madvise) {
+                    spans.push_back({(uintptr_t)action.ptr,
+                                     (uintptr_t)action.ptr + action.size});
+                }
+            }
+            std::sort(spans.begin(), spans.end());
+            for (auto const &[begin, end]: spans) {
+                if (!clusters.empty() && begin <= clusters.back().second) {
+                    clusters.back().second =
+                        std::max(clusters.back().second, end);
+                } else {
+                    clusters.push_back({begin, end});
+                }
+            }
+            double sum = 0;
+            for (auto const &[begin, end]: clusters) {
+                LifeBlock cluster{};
+                cluster.size = end - begin;
+                cluster_height.push_back(std::max(eval_height(cluster), 1.0));
+                sum += cluster_height.back();
+            }
+            double y = lane_top;
+            for (auto &height: cluster_height) {
+                height *= options.region_height / sum;
+                cluster_y.push_back(y);
+                y += height;
+            }
+            full_height = lane_top + options.region_height;
+        }
+        // line charts of the sampled counters, the byte counts share one
+        // scale so that RSS can be read against the traced live bytes
+        struct Chart {
+            std::vector<std::pair<std::string, Series const *>> lines;
+            double top = 0;
+            double max_value = 1;
+        };
+        std::vector<Chart> charts;
+        if (!counters.empty() && options.counter_height) {
+            Chart bytes;
+            Chart faults;
+            for (auto const &[kind, series]: counters) {
+                bool is_fault =
+                    kind == (size_t)CounterKind::MinorFaults ||
+                    kind == (size_t)CounterKind::MajorFaults;
+                (is_fault ? faults : bytes)
+                    .lines.push_back({kCounterKindNames[kind], &series});
+            }
+            bytes.lines.push_back({"TracedLive", &live_bytes});
+            for (auto chart: {bytes, faults}) {
+                if (chart.lines.empty()) {
+                    continue;
+                }
+                for (auto const &[_, series]: chart.lines) {
+                    for (auto const &point: *series) {
+                        chart.max_value =
+                            std::max(chart.max_value, point.second);
+                    }
+                }
+                chart.top = full_height + options.text_max_height;
+                full_height = chart.top + options.counter_height;
+                charts.push_back(chart);
+            }
+        }
+
+        auto region_y = [&](uintptr_t p) -> double {
+            size_t i = std::upper_bound(clusters.begin(), clusters.end(),
+                                        std::make_pair(p, UINTPTR_MAX)) -
+                       clusters.begin() - 1;
+            auto [begin, end] = clusters[i];
+            return cluster_y[i] + (double)(p - begin) / (double)(end - begin) *
+                                      cluster_height[i];
+        };
+
+        SvgWriter svg(options.path, total_width, full_height,
+                      options.svg_margin);
         double y = 0;
         std::cerr << "Generating SVG graph...\n";
         if (options.layout == PlotOptions::Address) {
@@ -741,6 +1935,92 @@ void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions) {
             }
         }
 
+        if (!clusters.empty()) {
+            std::cerr << "Drawing " << region_blocks.size()
+                      << " mapped regions...\n";
+            auto region_color = [](AllocOp op) -> std::string {
+                if (op == AllocOp::Brk) {
+                    return hsvToRgb(0.3, 0.7, 0.7);
+                } else if (op == AllocOp::Mremap) {
+                    return hsvToRgb(0.8, 0.7, 0.7);
+                }
+                return hsvToRgb(0.6, 0.7, 0.7);
+            };
+            for (auto const &block: region_blocks) {
+                double x = (block.start_time - start_time) * width_scale;
+                double width = std::max(
+                    (block.end_time - block.start_time) * width_scale, 1.0);
+                double y0 = region_y(block.begin);
+                double y1 = region_y(block.end - 1);
+                svg.rect(x, y0, width, std::max(y1 - y0, 1.0),
+                         region_color(block.op));
+            }
+            for (auto const &action: regions) {
+                if (action.op != AllocOp::Madvise || !action.size) {
+                    continue;
+                }
+                double x = (action.time - start_time) * width_scale;
+                double y0 = region_y((uintptr_t)action.ptr);
+                double y1 = region_y((uintptr_t)action.ptr + action.size - 1);
+                svg.rect(x, y0, 1, std::max(y1 - y0, 1.0),
+                         hsvToRgb(0.08, 0.8, 0.9));
+            }
+            svg.text(0, lane_top + options.text_max_height * 0.5, "white",
+                     " style=\"dominant-baseline:central;text-anchor:end;"
+                     "font-size:" +
+                         std::to_string(options.text_max_height) + "px;\"",
+                     "address space ");
+        }
+
+        size_t num_lines = 0;
+        for (auto const &chart: charts) {
+            num_lines += chart.lines.size();
+        }
+        size_t line_index = 0;
+        for (auto const &chart: charts) {
+            double bottom = chart.top + options.counter_height;
+            svg.rect(0, bottom, total_width, 1, "gray");
+            double legend_y = chart.top;
+            for (auto const &[name, series]: chart.lines) {
+                auto color =
+                    hsvToRgb(line_index++ * 1.0 / num_lines, 0.7, 0.9);
+                std::vector<std::pair<double, double>> points;
+                for (auto const &[time, value]: *series) {
+                    points.push_back(
+                        {(time - start_time) * width_scale,
+                         bottom - value / chart.max_value *
+                                      options.counter_height});
+                }
+                svg.polyline(points, color);
+                legend_y += options.text_max_height;
+                svg.text(0, legend_y, color,
+                         " style=\"text-anchor:end;font-size:" +
+                             std::to_string(options.text_max_height) +
+                             "px;\"",
+                         name + " ");
+            }
+            svg.text(0, bottom, "gray",
+                     " style=\"text-anchor:end;font-size:" +
+                         std::to_string(options.text_max_height) + "px;\"",
+                     "max " + std::to_string((uint64_t)chart.max_value) +
+                         " ");
+        }
+
+        for (auto const &[time, tag]: markers) {
+            if (time < start_time || time > end_time) {
+                continue;
+            }
+            double x = (time - start_time) * width_scale;
+            svg.rect(x, 0, 1, full_height, "white");
+            if (!tag) {
+                continue;
+            }
+            svg.text(x + 2, options.text_max_height, "white",
+                     " style=\"font-size:" +
+                         std::to_string(options.text_max_height) + "px;\"",
+                     tag_name(tag));
+        }
+
         std::cerr << "Writing SVG file...\n";
 
     } else if (options.format == PlotOptions::Console) {
@@ -2,6 +2,7 @@
 
 #include "alloc_action.hpp"
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -21,6 +22,8 @@ struct PlotOptions {
     enum PlotIndicate {
         Thread,
         Caller,
+        Tag,
+        Resource,
     };
 
     enum PlotLayout {
@@ -28,13 +31,21 @@ struct PlotOptions {
         Address,
     };
 
+    enum PlotCaller {
+        ReturnAddress,
+        FirstUserFrame,
+    };
+
     PlotFormat format = Svg;
     std::string path = "";
 
     PlotScale height_scale = Sqrt;
     PlotIndicate z_indicates = Thread;
-    // PlotIndicate color_indicates = Caller;
+    PlotIndicate color_indicates = Caller;
     PlotLayout layout = Timeline;
+    // with call stacks captured, color and label by the first frame outside
+    // the standard library instead of the immediate return address
+    PlotCaller caller = FirstUserFrame;
 
     bool show_text = true;
     size_t text_max_height = 24;
@@ -43,10 +54,52 @@ struct PlotOptions {
     bool filter_cpp = true;
     bool filter_c = true;
     bool filter_cuda = true;
+    // blocks of mallocvis::tracing_resource instances
+    bool filter_pmr = true;
+    // only plot blocks allocated under the mallocvis::Scope of this name
+    std::string tag_filter;
+    // with latencies captured, how many callsites and calls to list in the
+    // latency report
+    size_t slowest = 10;
+    // with usable sizes captured, how many callsites and size classes to list
+    // in the fragmentation report
+    size_t wasteful = 10;
+    // with thread events captured, how many threads and thread groups to
+    // list in the thread report
+    size_t top_threads = 10;
+    // with CPUs captured, how many callsites to list in the report of blocks
+    // freed on another CPU or NUMA node than the one that allocated them
+    size_t cross_cpu = 10;
 
     size_t svg_margin = 420;
     size_t svg_width = 2000;
     size_t svg_height = 1460;
+    // height of the address space lane drawn below the blocks when mmap:1
+    // captured region events
+    size_t region_height = 400;
+    // height of each line chart of the counters sampled with counters:<ms>
+    size_t counter_height = 300;
 };
 
 void mallocvis_plot_alloc_actions(std::vector<AllocAction> actions);
+// stacks[id] holds the frames of AllocAction::stack == id, innermost first,
+// tags[id] the name of AllocAction::tag == id; `forked` names the output as
+// for a process forked from a traced parent, see mallocvis_output_path
+void mallocvis_plot_alloc_actions(
+    std::vector<AllocAction> actions,
+    std::vector<std::vector<void *>> const &stacks,
+    std::vector<std::string> const &tags = {}, bool forked = false);
+// parse the whole of v as the number given to option k, sizes also taking a
+// k/m/g suffix, e.g. "512k"; a malformed value is reported and leaves out
+// unchanged, so that a typo in MALLOCVIS keeps the default instead of
+// throwing before main
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            size_t &out);
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            int64_t &out);
+bool mallocvis_parse_option(std::string const &k, std::string const &v,
+                            double &out);
+// replaces %p in an output path by the process id; a forked process also
+// gets its id before the extension of a path without %p, so that it does
+// not overwrite the output of its parent
+std::string mallocvis_output_path(std::string const &path, bool forked);
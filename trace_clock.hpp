@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+# if defined(__GNUC__)
+#  include <cpuid.h>
+#  include <x86intrin.h>
+# endif
+#elif defined(_M_X64) || defined(_M_IX86)
+# include <intrin.h>
+#endif
+
+enum class TraceClockKind : uint32_t {
+    Monotonic,
+    Coarse,
+    Tsc,
+};
+
+inline int64_t trace_clock_monotonic() {
+#if __unix__
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+inline int64_t trace_clock_coarse() {
+#if __unix__ && defined(CLOCK_MONOTONIC_COARSE)
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+#else
+    return trace_clock_monotonic();
+#endif
+}
+
+// only trust counters that tick at a constant rate across cores and power
+// states, i.e. the invariant TSC on x86 and the generic timer on ARM64
+inline bool trace_clock_has_tsc() {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+        eax < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+#elif defined(_M_X64) || defined(_M_IX86)
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if ((unsigned)regs[0] < 0x80000007) {
+        return false;
+    }
+    __cpuid(regs, 0x80000007);
+    return regs[3] & (1 << 8);
+#elif defined(__aarch64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline int64_t trace_clock_tsc() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+    return (int64_t)__rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return (int64_t)ticks;
+#else
+    return trace_clock_monotonic();
+#endif
+}
+
+// rdtscp also returns TSC_AUX, where Linux keeps the CPU number in the low
+// 12 bits, so one instruction gives both the timestamp and the CPU
+inline bool trace_clock_has_rdtscp() {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    __linux__
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return edx & (1u << 27);
+#else
+    return false;
+#endif
+}
+
+inline int64_t trace_clock_tscp(uint32_t &cpu) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    unsigned aux;
+    int64_t ticks = (int64_t)__rdtscp(&aux);
+    cpu = aux & 0xfff;
+    return ticks;
+#else
+    cpu = 0;
+    return trace_clock_tsc();
+#endif
+}
+
+// pairs of (ticks, nanoseconds) taken at the start and end of capture, used
+// to convert raw ticks to nanoseconds after the fact; while streaming the
+// second pair is refreshed along the way, and until it is taken ticks are
+// returned unconverted
+struct TraceClockCalibration {
+    TraceClockKind kind = TraceClockKind::Monotonic;
+    int64_t ticks[2] = {0, 0};
+    int64_t ns[2] = {0, 0};
+
+    int64_t to_ns(int64_t t) const {
+        if (kind != TraceClockKind::Tsc || ticks[1] <= ticks[0]) {
+            return t;
+        }
+        double scale = (double)(ns[1] - ns[0]) / (double)(ticks[1] - ticks[0]);
+        return ns[0] + (int64_t)((double)(t - ticks[0]) * scale);
+    }
+};
@@ -1,6 +1,8 @@
 #include "alloc_action.hpp"
+#include "alloc_codec.hpp"
 #include <condition_variable>
 #include <deque>
+#include <filesystem>
 #include <fstream>
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
@@ -370,6 +372,12 @@ struct Rect {
 };
 
 void handle_action(AllocAction &action) {
+    // mappings and resource blocks overlap heap blocks, only the SVG
+    // plotter draws them apart
+    if (kAllocOpIsRegion[(size_t)action.op] ||
+        kAllocOpIsResource[(size_t)action.op]) {
+        return;
+    }
     if (kAllocOpIsAllocation[(size_t)action.op]) {
         lifes.insert({
             (uintptr_t)action.ptr,
@@ -541,23 +549,45 @@ void gl_thread() {
     glfwTerminate();
 }
 
-void io_thread() {
-    std::string path = "malloc.fifo";
-    if (access(path.c_str(), F_OK) == -1) {
-        mkfifo(path.c_str(), 0666);
-    }
-    std::ifstream in(path, std::ios::binary);
-    AllocAction action;
-    while (in.read((char *)&action, sizeof(AllocAction))) {
+void io_thread(std::string path) {
+    // times are in raw ticks under clock:tsc, converted with the latest
+    // calibration read so far
+    TraceMetadata meta;
+    auto on_action = [&](AllocAction action) {
+        trace_action_to_ns(action, meta.clock);
         std::lock_guard<std::mutex> lck(mtx);
         actions.push_back(action);
         cv.notify_one();
+    };
+    // a trace_dir left behind by a traced process, possibly after a crash;
+    // its calibration is only complete once every segment is read
+    if (std::filesystem::is_directory(path)) {
+        std::vector<AllocAction> raw;
+        read_trace_segments(
+            path,
+            [&](AllocAction const &action) {
+                raw.push_back(action);
+            },
+            &meta);
+        for (auto const &action: raw) {
+            on_action(action);
+        }
+        for (auto [pid, parent_pid]: meta.parent_pids) {
+            std::cout << "Process " << pid << " was forked from "
+                      << parent_pid << '\n';
+        }
+        return;
     }
+    if (access(path.c_str(), F_OK) == -1) {
+        mkfifo(path.c_str(), 0666);
+    }
+    std::ifstream in(path, std::ios::binary);
+    read_trace_frames(in, on_action, &meta);
 }
 
-int main() {
+int main(int argc, char **argv) {
     std::ios::sync_with_stdio(false);
-    std::thread io_th(io_thread);
+    std::thread io_th(io_thread, argc > 1 ? argv[1] : "malloc.fifo");
     std::thread gl_th(gl_thread);
     gl_th.join();
     io_th.join();